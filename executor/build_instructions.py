@@ -159,7 +159,7 @@ def generate_functions(name, flags, snippet, enc, functions, l2):
     l2.extend(filter(lambda x: x, map(lambda x: x[0] in flags and x[1] or "", additions)))
 
     # flag handling
-    f2 = ["LOADFLAGS", "SAVEFLAGS", "MODRM", "BYTE", "DIRECTION", "READONLY", "ASM", "RMW", "LOCK", "MOFS", "BITS", "QWORD"]
+    f2 = ["LOADFLAGS", "LOADCF", "SAVEFLAGS", "MODRM", "BYTE", "DIRECTION", "READONLY", "ASM", "RMW", "LOCK", "MOFS", "BITS", "QWORD"]
     if "SKIPMODRM" in flags:                    f2.remove("MODRM")
     if "IMM1" in flags and "BITS" in flags:     f2.remove("BITS")
     if name in ["cltd"]:                        f2.remove("DIRECTION")
@@ -310,13 +310,13 @@ opcodes += [(x, ["ASM", "EAX", "NO_OS", x in ["aaa", "aas"] and "LOADFLAGS", "SA
 	     ["#ifdef __x86_64__\n\tLogging::panic(\"Unable to execute '" + x + "'\\n\");\n#else\n\tasm volatile(\"mov (%%\" EXPAND(REG(cx)) \"), %%eax;" + x + ";mov %%eax, (%%\" EXPAND(REG(cx)) \")\" : \"+d\"(tmp_src), \"+c\"(tmp_dst) : : \"eax\");\n#endif\n"])
 	    for x in ["aaa", "aas", "daa", "das"]]
 opcodes += [(x, ["ASM", x in ["cmp", "test"] and "READONLY",
-	   		x in ["adc", "sbb"] and "LOADFLAGS",
+	   		x in ["adc", "sbb"] and "LOADCF",
 			x not in ["mov"] and "SAVEFLAGS",
 			x not in ["mov", "cmp",  "test"] and "RMW",
 			],
 	     ["mov[bwl] (%\" EXPAND(REG(dx)) \"), [EAX]", "[lock] %s[bwl] [EAX],(%%\" EXPAND(REG(cx)) \")"%x])
 	    for x in ["mov", "add", "adc", "sub", "sbb", "and", "or", "xor", "cmp", "test"]]
-opcodes += [(x, ["ASM", x not in ["not"] and "SAVEFLAGS", x in ["dec", "inc"] and "LOADFLAGS", "RMW"],
+opcodes += [(x, ["ASM", x not in ["not"] and "SAVEFLAGS", x in ["dec", "inc"] and "LOADCF", "RMW"],
 	     ["[lock] " + x + "[bwl] (%\" EXPAND(REG(cx)) \")"])
 	    for x in ["inc", "dec", "neg", "not"]]
 opcodes += [(x, ["ASM", "CONST1", x in ["rcr", "rcl"] and "LOADFLAGS", "SAVEFLAGS", "RMW"],
@@ -325,13 +325,10 @@ opcodes += [(x, ["ASM", "SAVEFLAGS", "DIRECTION"], ["%s[bwl] (%%\" EXPAND(REG(dx
 ccflags = map(lambda x: compile_and_disassemble(".byte %#x, 0x00"%x, file, fdict)[2].split()[0][1:], range(0x70, 0x80))
 for i in range(len(ccflags)):
     ccflag = ccflags[i]
-    opcodes += [("set" +ccflag, ["BYTE",   "ASM", "LOADFLAGS"], ["set%s (%%\" EXPAND(REG(cx)) \")"%ccflag])]
-    opcodes += [("cmov"+ccflag, ["NO_OS",  "ASM", "LOADFLAGS",  "OS2"], ["j%s 1f"%(ccflags[i ^ 1]), "mov (%\" EXPAND(REG(dx)) \"), %eax", "mov %eax, (%\" EXPAND(REG(cx)) \")", "1:"])]
-    # use call %P0 instead of call %c0; seems to be a gcc-bug that occurs with -mcmodel=large
-    # (see http://gcc.gnu.org/bugzilla/show_bug.cgi?id=46477)
-    opcodes += [("j"+ccflag,    ["JMP",   "ASM", "LOADFLAGS", "DIRECTION"],
-		 ['__attribute__((regparm(3))) int (*foo)(InstructionCache *, void *) = helper_JMP_static<[os]>',
-		  'asm volatile ("j%s 1f;call %%P0; 1:" : : "i"(foo))'%(ccflags[i ^ 1])])]
+    # conditions are evaluated from the stored flags, which avoids a popf
+    opcodes += [("set" +ccflag, ["BYTE"], ["*reinterpret_cast<unsigned char *>(tmp_dst) = cache->condition(%d)"%i])]
+    opcodes += [("cmov"+ccflag, ["NO_OS", "OS2"], ["if (cache->condition(%d)) move<2>(tmp_dst, tmp_src)"%i])]
+    opcodes += [("j"+ccflag,    ["JMP", "DIRECTION"], ["if (cache->condition(%d)) cache->helper_JMP<[os]>(tmp_src)"%i])]
 opcodes += [(x, [x[-1] == "b" and "BYTE", "HAS_OS"], [
             "unsigned dummy",
 	    "tmp_dst = cache->get_reg32((cache->_entry->data[cache->_entry->offset_opcode] >> 3) & 0x7)",
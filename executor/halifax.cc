@@ -47,3 +47,16 @@ PARAM_HANDLER(halifax,
   if (!mb.last_vcpu) Logging::panic("no VCPU for this Halifax");
   new Halifax(mb.last_vcpu);
 }
+
+#include "jit.h"
+
+PARAM_HANDLER(jit,
+	      "jit - create a halifax that additionally runs simple guest code natively.")
+{
+  if (!mb.last_vcpu) Logging::panic("no VCPU for this JIT");
+#ifdef __x86_64__
+  new Jit(mb.last_vcpu);
+#else
+  Logging::panic("the JIT needs an x86-64 host");
+#endif
+}
@@ -16,6 +16,7 @@
  * General Public License version 2 for more details.
  */
 #pragma once
+#include "executor/bios.h"
 
 #ifdef __i386__
 #define REG(X)          e ## X
@@ -105,6 +106,12 @@ struct InstructionCacheEntry
   unsigned modrminfo;
   unsigned cs_ar;
   unsigned prefixes;
+  // write generations of the code pages and the TLB at decode time
+  unsigned *gen_ptr[2];
+  unsigned gen[2];
+  unsigned tlb_gen;
+  // the last seen successors: fall-through and branch target
+  unsigned next[2];
   void __attribute__((regparm(3))) (*execute)(InstructionCache *instr, void *tmp_src, void *tmp_dst);
   void     *src;
   void     *dst;
@@ -118,7 +125,10 @@ struct InstructionCacheEntry
 class InstructionCache : public MemTlb
 {
   enum EFLAGS {
+    EFL_CF  = 1 <<  0,
+    EFL_PF  = 1 <<  2,
     EFL_ZF  = 1 <<  6,
+    EFL_SF  = 1 <<  7,
     EFL_TF  = 1 <<  8,
     EFL_IF  = 1 <<  9,
     EFL_OF  = 1 << 11,
@@ -145,12 +155,18 @@ class InstructionCache : public MemTlb
     IC_RMW       = 1 <<  9,
     IC_MOFS      = 1 << 10,
     IC_QWORD     = 1 << 11,
+    // only CF is an input, all other arithmetic flags are overwritten
+    IC_LOADCF    = 1 << 12,
   };
 
 
   enum {
     SIZE = 64,
-    ASSOZ = 4
+    ASSOZ = 4,
+    // maximum number of instructions executed per step
+    BATCH = 256,
+    // maximum number of REP iterations per step, a REP is resumed in the next step
+    REP_BUDGET = 8192
   };
 
   unsigned _pos;
@@ -162,8 +178,16 @@ class InstructionCache : public MemTlb
   // cpu state
   VCpu   * _vcpu;
   InstructionCacheEntry *_entry;
+  // index of the last executed entry or ~0u
+  unsigned _last;
+protected:
+  // optional translator that executes whole blocks, returns the number of executed instructions
+  unsigned (*_native)(InstructionCache *cache, unsigned budget);
+private:
   unsigned _oeip;
   unsigned _oesp;
+  // ESP at the start of the batch
+  unsigned _besp;
   unsigned _ointr_state;
   mword _dr6;
   mword _dr[4];
@@ -172,7 +196,9 @@ class InstructionCache : public MemTlb
   int send_message(CpuMessage::Type type)
   {
     CpuMessage msg(type, _cpu, _mtr_in);
+    DeviceGuard guard(_vcpu->device_lock);
     _vcpu->executor.send(msg, true);
+    _stop_batch = true;
     return _fault;
   }
 
@@ -202,34 +228,94 @@ class InstructionCache : public MemTlb
   }
 
 
+  /**
+   * Remember the write generations of the pages an entry was decoded
+   * from.  Another vCPU may have modified the code while we decoded
+   * it, thus we compare the code again after reading the generations.
+   * Returns false if the entry cannot be trusted.
+   */
+  bool record_gen(InstructionCacheEntry *entry, unsigned linear)
+  {
+    entry->gen_ptr[0] = code_gen(linear);
+    entry->gen_ptr[1] = code_gen(linear + entry->inst_len - 1);
+    entry->tlb_gen = _tlb_gen;
+    for (unsigned i = 0; i < 2; i++)
+      entry->gen[i] = entry->gen_ptr[i] ? *entry->gen_ptr[i] : 0;
+    Cpu::barrier();
+
+    InstructionCacheEntry tmp;
+    tmp.inst_len = 0;
+    if (fetch_code(&tmp, entry->inst_len) || memcmp(tmp.data, entry->data, entry->inst_len)) {
+      entry->gen_ptr[0] = 0;
+      return false;
+    }
+    return true;
+  }
+
+
+  /**
+   * Is the code of an entry unmodified since it was decoded?  Pages
+   * without a write generation, e.g. MMIO, are never trusted.
+   */
+  bool unmodified(InstructionCacheEntry *entry)
+  {
+    return entry->tlb_gen == _tlb_gen && entry->gen_ptr[0] && entry->gen_ptr[1]
+      && *entry->gen_ptr[0] == entry->gen[0] && *entry->gen_ptr[1] == entry->gen[1];
+  }
+
+
+  /**
+   * Check whether an entry is valid for the current state.
+   */
+  bool valid_entry(unsigned i, unsigned linear, unsigned cs_ar, unsigned limit)
+  {
+    if (linear != _tags[i] || !_values[i].inst_len || cs_ar != _values[i].cs_ar) return false;
+    if (unmodified(_values + i) && (!~limit || limit >= (_cpu->eip + _values[i].inst_len - 1))) return true;
+
+    // slow path: revalidate the entry by fetching the code again
+    return record_gen(_values + i, linear);
+  }
+
+
   /**
    * Find a cache entry for the given state and checks whether it is
    * still valid.
+   *
+   * The successors of the last instruction are tried first, thus
+   * straight-line code and loops are followed without hashing.
    */
   bool find_entry(unsigned &index)
   {
     unsigned cs_ar = READ(cs).ar;
+    unsigned limit = READ(cs).limit;
     unsigned linear = _cpu->eip + READ(cs).base;
+    unsigned *link = 0;
+    if (~_last) {
+      link = _values[_last].next + (linear != _tags[_last] + _values[_last].inst_len);
+      if (valid_entry(*link, linear, cs_ar, limit)) {
+	index = *link;
+	return true;
+      }
+      if (_fault) return false;
+    }
     for (unsigned i = slot(linear); i < slot(linear) + ASSOZ; i++)
-      if (linear == _tags[i] &&  _values[i].inst_len)
-	{
-	  InstructionCacheEntry tmp;
-	  tmp.inst_len = 0;
-	  // revalidate entries
-	  if (fetch_code(&tmp, _values[i].inst_len)) return false;
-
-	  // either code modified or two entries with different bases?
-	  if (memcmp(tmp.data, _values[i].data, _values[i].inst_len) || cs_ar != _values[i].cs_ar)  continue;
-	  index = i;
-	  //COUNTER_INC("I$ ok");
-	  return true;
-	}
+      {
+	if (valid_entry(i, linear, cs_ar, limit))
+	  {
+	    index = i;
+	    if (link) *link = i;
+	    //COUNTER_INC("I$ ok");
+	    return true;
+	  }
+	if (_fault) return false;
+      }
     // allocate new invalid entry
     index = slot(linear) + (_pos++ % ASSOZ);
     memset(_values + index, 0, sizeof(*_values));
     _values[index].cs_ar =  cs_ar;
     _values[index].prefixes = 0x8300; // default is to use the DS segment
     _tags[index] = linear;
+    if (link) *link = index;
     return false;
   }
 
@@ -299,6 +385,11 @@ public:
 	  }
 
 	assert(_values[index].execute);
+	if (!record_gen(_entry, _cpu->eip + READ(cs).base) && _fault)
+	  {
+	    _entry->inst_len = 0;
+	    return _fault;
+	  }
 	//COUNTER_INC("decoded");
       }
     _entry = _values + index;
@@ -404,7 +495,7 @@ public:
   {
     mword tmp_flag;
     unsigned dummy1, dummy2, dummy3;
-    switch (_entry->flags & (IC_LOADFLAGS | IC_SAVEFLAGS))
+    switch (_entry->flags & (IC_LOADFLAGS | IC_LOADCF | IC_SAVEFLAGS))
       {
       case IC_SAVEFLAGS:
 	asm volatile ("call *%4; pushf; pop %3"
@@ -419,6 +510,15 @@ public:
 		      : PARAM1(dummy1), PARAM2(dummy2), PARAM3(dummy3), "+g"(tmp_flag)
 		      : "m"(_entry->execute), "0"(this), "1"(tmp_src), "2"(tmp_dst) : CLOBBER);
 	break;
+      case IC_LOADCF | IC_SAVEFLAGS:
+	// setting CF is much cheaper than a popf
+	tmp_flag = _cpu->efl;
+	asm volatile ("bt $0, %3; call *%4; pushf; pop %3"
+		      : PARAM1(dummy1), PARAM2(dummy2), PARAM3(dummy3), "+r"(tmp_flag)
+		      : "m"(_entry->execute), "0"(this), "1"(tmp_src), "2"(tmp_dst) : CLOBBER);
+	_cpu->efl = (_cpu->efl & ~0x8d5) | (tmp_flag  & 0x8d5);
+	_mtr_out |= MTD_RFLAGS;
+	break;
       case IC_LOADFLAGS | IC_SAVEFLAGS:
 	tmp_flag = _cpu->efl & 0x8d5;
 	asm volatile ("push %3; popf; call *%4; pushf; pop %3"
@@ -436,6 +536,28 @@ public:
   }
 
 
+  /**
+   * Evaluate a condition code of jcc, setcc or cmovcc.
+   */
+  bool condition(unsigned cc)
+  {
+    unsigned efl = _cpu->efl;
+    bool res;
+    switch (cc >> 1)
+      {
+      case 0: res = efl & EFL_OF; break;
+      case 1: res = efl & EFL_CF; break;
+      case 2: res = efl & EFL_ZF; break;
+      case 3: res = efl & (EFL_CF | EFL_ZF); break;
+      case 4: res = efl & EFL_SF; break;
+      case 5: res = efl & EFL_PF; break;
+      case 6: res = !(efl & EFL_SF) != !(efl & EFL_OF); break;
+      default: res = efl & EFL_ZF || !(efl & EFL_SF) != !(efl & EFL_OF); break;
+      }
+    return res ^ (cc & 1);
+  }
+
+
   /**
    * Execute the instruction.
    */
@@ -494,24 +616,26 @@ public:
 
   /**
    * Commits the instruction by setting the appropriate UTCB fields.
+   * Retired is the number of instructions of the batch that completed
+   * before the last one.
    */
-  bool commit()
+  bool commit(unsigned retired)
   {
     // irq blocking propagation
     if (_fault)  _cpu->intr_state = _ointr_state;
     if (_cpu->intr_state != _ointr_state)
       _mtr_out |= MTD_STATE;
 
-    if (!_fault || _fault == FAULT_RETRY)
+    if (!_fault || _fault == FAULT_RETRY || retired)
       {
-	// successfull
+	// successfull, or earlier instructions of the batch are
 	_mtr_out |= MTD_RIP_LEN | MTD_GPR_ACDB | MTD_GPR_BSD;
-	if (_cpu->esp != _oesp) _mtr_out |= MTD_RSP;
+	if (_cpu->esp != _besp) _mtr_out |= MTD_RSP;
 
 	// XXX bugs?
 	_mtr_out |= _mtr_in & ~(MTD_CR | MTD_TSC);
       }
-    else
+    if (_fault && _fault != FAULT_RETRY)
       {
 	_cpu->eip = _oeip;
 	if (~_fault & 0x80000000)
@@ -541,6 +665,7 @@ public:
 		_cpu->inj_info = 0;
 		// triple fault
 		CpuMessage msg(CpuMessage::TYPE_TRIPLE, _cpu, _mtr_in);
+		DeviceGuard guard(_vcpu->device_lock);
 		_vcpu->executor.send(msg, true);
 	      }
 	    else
@@ -562,23 +687,48 @@ public:
 
 public:
 
+  /**
+   * Could a pending interrupt be injected now?
+   */
+  bool irq_window() {
+    return _cpu->inj_info & INJ_IRQWIN && _cpu->efl & EFL_IF && !(_cpu->intr_state & 3);
+  }
+
+  /**
+   * Execute a batch of instructions.  We leave early on faults, I/O,
+   * MMIO, HLT and when the blocking state changes, as the VCpu has to
+   * see these.  Entering a vector that the VBios hooks ends a batch
+   * as well.  Everything else is committed once per batch.
+   */
   void step(CpuMessage &msg) {
     _cpu = msg.cpu;
     _mtr_in = msg.mtr_in;
     _mtr_out =  msg.mtr_out;
     _fault = 0;
+    _stop_batch = false;
+    _last = ~0u;
     if (!init()) {
-      _entry = 0;
-      _oeip = _cpu->eip;
-      _oesp = _cpu->esp;
-      _ointr_state = _cpu->intr_state;
-      // remove sti+movss blocking
-      _cpu->intr_state &= ~3;
-      event_injection() || get_instruction() || execute();
-      if (commit()) invalidate(true);
+      unsigned count = 0, retired;
+      _besp = _cpu->esp;
+      do {
+	unsigned native = 0;
+	retired = count;
+	_entry = 0;
+	_oeip = _cpu->eip;
+	_oesp = _cpu->esp;
+	_ointr_state = _cpu->intr_state;
+	// remove sti+movss blocking
+	_cpu->intr_state &= ~3;
+	event_injection() || _native && (native = _native(this, BATCH - count)) || get_instruction() || execute();
+	bump_written();
+	_last = _fault || !_entry ? ~0u : _entry - _values;
+	count += native ? native : 1;
+      } while (!_fault && !_stop_batch && count < BATCH && _cpu->intr_state == _ointr_state && !BiosCommon::hooked_vector(_cpu) && !irq_window());
+      COUNTER_INC("batch");
+      if (commit(retired)) invalidate(true);
     }
     msg.mtr_out = _mtr_out;
   }
 
- InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _oeip(), _oesp(), _ointr_state(), _dr6(), _dr(), _fpustate() { }
+ InstructionCache(VCpu *vcpu) : MemTlb(vcpu->mem, vcpu->memregion, vcpu->device_lock), _pos(), _tags(), _values(), _vcpu(vcpu), _entry(), _last(~0u), _native(), _oeip(), _oesp(), _besp(), _ointr_state(), _dr6(), _dr(), _fpustate() { }
 };
@@ -304,20 +304,24 @@ helper_SDT(SGDT,gd, MTD_GDTR)
   }
 
   template<unsigned operand_size>
-  void __attribute__((regparm(3)))  helper_IN(unsigned port, void *dst)
+  void __attribute__((regparm(3)))  helper_IN(unsigned port, void *dst, unsigned count = 1)
   {
     // XXX check IOPBM
-    CpuMessage msg(true, _cpu, operand_size, port, dst, _mtr_in);
+    CpuMessage msg(true, _cpu, operand_size, port, dst, _mtr_in, count);
+    DeviceGuard guard(_vcpu->device_lock);
     _vcpu->executor.send(msg, true);
+    _stop_batch = true;
   }
 
   template<unsigned operand_size>
-  void __attribute__((regparm(3)))  helper_OUT(unsigned port, void *dst)
+  void __attribute__((regparm(3)))  helper_OUT(unsigned port, void *dst, unsigned count = 1)
   {
 
     // XXX check IOPBM
-    CpuMessage msg(false, _cpu, operand_size, port, dst, _mtr_in);
+    CpuMessage msg(false, _cpu, operand_size, port, dst, _mtr_in, count);
+    DeviceGuard guard(_vcpu->device_lock);
     _vcpu->executor.send(msg, true);
+    _stop_batch = true;
   }
 
 /**
@@ -346,13 +350,100 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
     SH_DOOP_OUT = 1 << 6
   };
 
+  /**
+   * Get a pointer to the elements of a string operand that are on the
+   * same RAM page.  Limits n to these elements and returns false if
+   * they need the slow path, e.g. on MMIO, a TLB miss or a fault.
+   */
+  template<unsigned operand_size>
+  bool string_range(CpuState::Descriptor *desc, unsigned virt, bool down, bool write, unsigned &n, char *&ptr)
+  {
+    unsigned size = 1 << operand_size;
+    unsigned linear = virt + desc->base;
+    unsigned offset = linear & 0xfff;
+    if (offset > 0x1000 - size) return false;
+    unsigned avail = down ? offset / size + 1 : (0x1000 - offset) / size;
+    if (n > avail) n = avail;
+
+    // the segment checks of handle_segment() for the whole range, expand-down segments are left to it
+    unsigned low = down ? virt - (n - 1) * size : virt;
+    if (low > virt || low + n * size - 1 < low || low + n * size - 1 > desc->limit || (desc->ar & 0xc) == 4) return false;
+    if (~desc->ar & 0x80 || !write && ((desc->ar & 0xa) == 0x8) || write && (desc->ar & 0xa) != 0x2) return false;
+
+    TlbEntry *entry = tlb_cached(linear, user_access(write ? TYPE_W : TYPE_R));
+    if (!entry || !entry->_ptr) return false;
+    if (write && entry->_gen) will_write(entry->_gen);
+    ptr = entry->_ptr + offset;
+    return true;
+  }
+
+
+  /**
+   * Execute up to max elements of a REP MOVS, STOS, LODS, INS or OUTS
+   * up to the next page boundary directly on RAM.  Returns the number
+   * of elements or 0 if the next element has to be done by the slow
+   * path, so that faults are still reported at the exact element.
+   */
+  template<unsigned feature, unsigned operand_size>
+  unsigned string_chunk(unsigned max)
+  {
+    if (feature & (SH_LOAD_EDI | SH_DOOP_CMP) || _entry->address_size != 2 || !(_entry->prefixes & 0xff)) return 0;
+
+    bool down = _cpu->efl & 0x400;
+    // string I/O is only transferred upwards at once
+    if (feature & (SH_DOOP_IN | SH_DOOP_OUT) && down) return 0;
+    int size = down ? -(1 << operand_size) : (1 << operand_size);
+    unsigned n = _cpu->ecx < max ? _cpu->ecx : max;
+    char *src = 0, *dst = 0;
+    if (feature & SH_LOAD_ESI && !string_range<operand_size>((&_cpu->es) + ((_entry->prefixes >> 8) & 0xf), _cpu->esi, down, false, n, src)) return 0;
+    if (feature & SH_SAVE_EDI && !string_range<operand_size>(&_cpu->es, _cpu->edi, down, true, n, dst)) return 0;
+    if (n < 2) return 0;
+    COUNTER_INC("rep chunk");
+
+    if (feature & SH_DOOP_IN)
+      helper_IN<operand_size>(_cpu->dx, dst, n);
+    else if (feature & SH_DOOP_OUT)
+      helper_OUT<operand_size>(_cpu->dx, src, n);
+    else if (feature & SH_LOAD_ESI && feature & SH_SAVE_EDI) {
+      unsigned len = n << operand_size;
+      if (dst + len <= src || src + len <= dst)
+	memcpy(down ? dst - len - size : dst, down ? src - len - size : src, len);
+      else
+	// overlapping copies are defined element by element
+	for (unsigned i = 0; i < n; i++) move<operand_size>(dst + int(i) * size, src + int(i) * size);
+    }
+    else if (feature & SH_SAVE_EDI) {
+      if (!operand_size)
+	memset(down ? dst - n + 1 : dst, _cpu->al, n);
+      else
+	for (unsigned i = 0; i < n; i++) move<operand_size>(dst + int(i) * size, &_cpu->eax);
+    }
+    else
+      move<operand_size>(&_cpu->eax, src + int(n - 1) * size);
+
+    if (feature & SH_LOAD_ESI) _cpu->esi += n * size;
+    if (feature & SH_SAVE_EDI) _cpu->edi += n * size;
+    _cpu->ecx -= n;
+    return n;
+  }
+
+
 #define NCHECK(X)  { if (X) break; }
 #define FEATURE(X,Y) { if (feature & (X)) Y; }
   template<unsigned feature, unsigned operand_size>
   int __attribute__((regparm(3)))  string_helper()
   {
+    unsigned budget = REP_BUDGET;
     while (_entry->address_size == 1 && _cpu->cx || _entry->address_size == 2 && _cpu->ecx || !(_entry->prefixes & 0xff))
       {
+	// restart the instruction in the next step, so that interrupts are not delayed
+	if (!budget) {
+	  COUNTER_INC("rep preempt");
+	  _cpu->eip = _oeip;
+	  break;
+	}
+	unsigned n = string_chunk<feature, operand_size>(budget);
+	if (n) { budget -= n; continue; }
 	void *src = &_cpu->eax;
 	void *dst = &_cpu->eax;
 
@@ -372,9 +463,10 @@ int calc_flags(unsigned operand_size, void *src, void *dst) {
 	if (_entry->address_size == 1)  _cpu->cx--; else _cpu->ecx--;
 	FEATURE(SH_DOOP_CMP,  if (((_entry->prefixes & 0xff) == 0xf3)  && (~_cpu->efl & 0x40))  break);
 	FEATURE(SH_DOOP_CMP,  if (((_entry->prefixes & 0xff) == 0xf2)  && ( _cpu->efl & 0x40))  break);
-
-	// XXX check for interrupts
+	budget--;
       }
+    // a long running REP should not delay interrupts even further
+    if (_entry->prefixes & 0xff) _stop_batch = true;
     return _fault;
   }
 
@@ -420,8 +512,8 @@ int helper_MOV__EDX__CR0()
   *tmp_dst = tmp;
   _mtr_out |= MTD_CR;
 
-  // XXX flush only if paging-bits change
-  // update TLB
+  // CR0, CR3 and CR4 writes flush the TLB, a CR4.PGE toggle is a global flush
+  if (tmp_dst != &_cpu->cr2) tlb_flush();
   return init();
 }
 
@@ -884,7 +976,11 @@ int idt_traversal(unsigned event, unsigned error_code)
 
 
 int helper_INT(unsigned char vector) { return idt_traversal(0x80000600 | vector, 0); }
-int helper_INVLPG() { return _fault; }
+int helper_INVLPG()
+{
+  tlb_flush_page((&_cpu->es)[(_entry->prefixes >> 8) & 0xf].base + modrm2virt());
+  return _fault;
+}
 int helper_FWAIT()                              { return _fault; }
 int helper_MOV__DB0__EDX()
 {
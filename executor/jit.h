@@ -0,0 +1,705 @@
+/** @file
+ * Dynamic binary translation for Halifax.
+ *
+ * This file is part of Seoul.
+ *
+ * Seoul is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Seoul is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+#pragma once
+
+#ifdef __x86_64__
+#include <sys/mman.h>
+
+/**
+ * A Halifax that runs blocks of simple guest code natively on an
+ * x86-64 host.
+ *
+ * Only code in flat 32-bit protected mode is translated.  A block
+ * consists of integer instructions with register and memory operands
+ * and ends at the first branch or at an instruction we do not
+ * handle, which is then executed by Halifax.  The guest registers
+ * live in the same host registers, except ESP that is kept in R15.
+ * Memory operands go through a small TLB that is filled from the
+ * Halifax TLB.  A miss leaves the instruction to Halifax as well.
+ *
+ * Blocks are keyed by the linear address and the CS attributes and
+ * are checked against the write generation of their code page.
+ * Pages with translated code are never writable through the TLB of
+ * the translated code, thus self-modifying code leaves a block
+ * before the write.
+ */
+class Jit : public Halifax
+{
+  enum {
+    CODE_SIZE   = 4 << 20,
+    BLOCKS      = 1024,
+    BLOCK_INSTS = 32,
+    TLB_ENTRIES = 256,
+    CODE_PAGES  = 256,
+    TAG_INVALID = 0xfff,
+    ARITH_FLAGS = 0x8d5,
+  };
+
+  /**
+   * An entry of the TLB used by the translated code.
+   */
+  struct JitTlb {
+    unsigned   read;
+    unsigned   write;
+    char      *addend;   // host address minus guest address
+    unsigned  *gen;      // write generation of the page
+    uintptr_t  phys;
+  };
+
+  /**
+   * The guest state while running translated code.
+   */
+  struct Frame {
+    unsigned      gpr[8];
+    unsigned long efl;
+    char         *code;
+    JitTlb       *tlb;
+    unsigned      eip;
+    unsigned      exit;  // executed instructions << 8 | type of a TLB miss
+    unsigned      addr;  // address of a TLB miss
+  };
+
+  struct Block {
+    unsigned   linear;
+    unsigned   cs_ar;
+    char      *code;     // 0 if the code cannot be translated
+    unsigned  *gen;
+    unsigned   gen_value;
+  };
+
+  /**
+   * A decoded guest instruction.
+   */
+  struct Inst {
+    enum Kind { NORMAL, LEA, EMBEDDED, INCDEC, JCC, JMP, LOOP, JECXZ };
+    Kind kind;
+    unsigned eip;
+    unsigned len;
+    unsigned opcode_pos;
+    unsigned char op;
+    bool twobyte, opsize, lock;
+    bool modrm;
+    unsigned modrm_pos, mod, reg, rm;
+    unsigned imm_pos, imm_len;
+    bool reg_is_reg, byte_reg, byte_rm;
+    unsigned size;      // size of the memory access
+    unsigned access;    // type of the memory access
+    bool flags_read;    // reads arithmetic flags
+    bool flags_write;   // overwrites all arithmetic flags
+    bool flags_live;    // flags are live before the instruction
+    bool flags_live_out; // flags are live after the instruction
+    unsigned target;
+  };
+
+  struct Fixup {
+    unsigned pos;
+    unsigned index;
+    unsigned eip;
+    unsigned type;
+    bool     live;
+  };
+
+  char     *_code;
+  unsigned  _code_pos;
+  unsigned  _code_start;
+  void    (*_trampoline)(Frame *frame);
+  Block     _blocks[BLOCKS];
+  JitTlb    _jtlb[TLB_ENTRIES];
+  unsigned  _jtlb_gen;
+  unsigned  _jtlb_cpl;
+  uintptr_t _code_pages[CODE_PAGES];
+  unsigned  _code_page_count;
+  unsigned  _dummy_gen;
+  unsigned  _miss_type;
+  unsigned  _miss_addr;
+  bool      _miss_seen;
+
+  void emit(unsigned char value) { _code[_code_pos++] = value; }
+  void emit4(unsigned value) { memcpy(_code + _code_pos, &value, 4); _code_pos += 4; }
+  void emit(const char *bytes, unsigned len) { memcpy(_code + _code_pos, bytes, len); _code_pos += len; }
+
+
+  /**
+   * Decode and check a guest instruction.  Returns false for
+   * everything we do not translate.
+   */
+  bool decode(const unsigned char *p, unsigned avail, unsigned eip, Inst &in)
+  {
+    memset(&in, 0, sizeof(in));
+    unsigned i = 0;
+    for (;; i++) {
+      if (i >= avail || i > 3) return false;
+      if (p[i] == 0x66)      in.opsize = true;
+      else if (p[i] == 0xf0) in.lock = true;
+      // segment overrides are ignored as all segments are flat
+      else if (p[i] != 0x26 && p[i] != 0x2e && p[i] != 0x36 && p[i] != 0x3e) break;
+    }
+    in.twobyte = p[i] == 0x0f;
+    if (in.twobyte && ++i >= avail) return false;
+    in.opcode_pos = i;
+    unsigned char op = in.op = p[i++];
+    unsigned iz = in.opsize ? 2 : 4;
+    unsigned imm = 0;
+    enum { NONE, GROUP1, SHIFT, MOVIMM, GROUP3, INCDEC, GROUP8, SETCC, REGONLY } group = NONE;
+    in.size = iz;
+    in.reg_is_reg = true;
+
+    if (!in.twobyte && op < 0x40 && (op & 7) < 6) {
+      unsigned alu = op >> 3;
+      in.flags_read = alu == 2 || alu == 3;
+      in.flags_write = true;
+      in.access = alu == 7 ? TYPE_R : TYPE_RMW;
+      switch (op & 7) {
+      case 0: in.modrm = in.byte_reg = in.byte_rm = true; break;
+      case 1: in.modrm = true; break;
+      case 2: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_R; break;
+      case 3: in.modrm = true; in.access = TYPE_R; break;
+      case 4: imm = 1; break;
+      case 5: imm = iz; break;
+      }
+    }
+    else if (!in.twobyte)
+      switch (op) {
+      case 0x40 ... 0x4f: in.kind = Inst::INCDEC; break;
+      case 0x69: in.modrm = true; in.access = TYPE_R; in.flags_write = true; imm = iz; break;
+      case 0x6b: in.modrm = true; in.access = TYPE_R; in.flags_write = true; imm = 1; break;
+      case 0x70 ... 0x7f: in.kind = Inst::JCC; in.flags_read = true; imm = 1; break;
+      case 0x80: in.modrm = in.byte_rm = true; group = GROUP1; imm = 1; break;
+      case 0x81: in.modrm = true; group = GROUP1; imm = iz; break;
+      case 0x83: in.modrm = true; group = GROUP1; imm = 1; break;
+      case 0x84: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_R; in.flags_write = true; break;
+      case 0x85: in.modrm = true; in.access = TYPE_R; in.flags_write = true; break;
+      case 0x86: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_RMW; break;
+      case 0x87: in.modrm = true; in.access = TYPE_RMW; break;
+      case 0x88: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_W; break;
+      case 0x89: in.modrm = true; in.access = TYPE_W; break;
+      case 0x8a: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_R; break;
+      case 0x8b: in.modrm = true; in.access = TYPE_R; break;
+      case 0x8d: in.modrm = true; in.kind = Inst::LEA; break;
+      case 0x90: case 0x98: case 0x99: break;
+      case 0x91 ... 0x97: in.kind = Inst::EMBEDDED; break;
+      case 0xa8: in.flags_write = true; imm = 1; break;
+      case 0xa9: in.flags_write = true; imm = iz; break;
+      case 0xb0 ... 0xb7: imm = 1; break;
+      case 0xb8 ... 0xbf: in.kind = Inst::EMBEDDED; imm = iz; break;
+      case 0xc0: in.modrm = in.byte_rm = true; group = SHIFT; imm = 1; break;
+      case 0xc1: in.modrm = true; group = SHIFT; imm = 1; break;
+      case 0xc6: in.modrm = in.byte_rm = true; group = MOVIMM; imm = 1; break;
+      case 0xc7: in.modrm = true; group = MOVIMM; imm = iz; break;
+      case 0xd0: case 0xd2: in.modrm = in.byte_rm = true; group = SHIFT; break;
+      case 0xd1: case 0xd3: in.modrm = true; group = SHIFT; break;
+      case 0xe2: in.kind = Inst::LOOP; imm = 1; break;
+      case 0xe3: in.kind = Inst::JECXZ; imm = 1; break;
+      case 0xe9: in.kind = Inst::JMP; imm = 4; break;
+      case 0xeb: in.kind = Inst::JMP; imm = 1; break;
+      case 0xf5: in.flags_read = true; break;
+      case 0xf8: case 0xf9: break;
+      case 0xf6: in.modrm = in.byte_rm = true; group = GROUP3; break;
+      case 0xf7: in.modrm = true; group = GROUP3; break;
+      case 0xfe: in.modrm = in.byte_rm = true; group = INCDEC; break;
+      case 0xff: in.modrm = true; group = INCDEC; break;
+      default: return false;
+      }
+    else
+      switch (op) {
+      case 0x40 ... 0x4f: in.modrm = true; in.access = TYPE_R; in.flags_read = true; break;
+      case 0x80 ... 0x8f: in.kind = Inst::JCC; in.flags_read = true; imm = 4; break;
+      case 0x90 ... 0x9f: in.modrm = in.byte_rm = true; group = SETCC; in.access = TYPE_W; in.flags_read = true; break;
+      case 0xa3: in.modrm = true; group = REGONLY; break;
+      case 0xa4: case 0xac: in.modrm = true; in.access = TYPE_RMW; imm = 1; break;
+      case 0xa5: case 0xad: in.modrm = true; in.access = TYPE_RMW; break;
+      case 0xab: case 0xb3: case 0xbb: in.modrm = true; group = REGONLY; break;
+      case 0xaf: in.modrm = true; in.access = TYPE_R; in.flags_write = true; break;
+      case 0xb0: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_RMW; in.flags_write = true; break;
+      case 0xb1: in.modrm = true; in.access = TYPE_RMW; in.flags_write = true; break;
+      case 0xb6: case 0xbe: in.modrm = in.byte_rm = true; in.access = TYPE_R; break;
+      case 0xb7: case 0xbf: in.modrm = true; in.access = TYPE_R; in.size = 2; break;
+      case 0xba: in.modrm = true; group = GROUP8; imm = 1; break;
+      case 0xbc: case 0xbd: in.modrm = true; in.access = TYPE_R; break;
+      case 0xc0: in.modrm = in.byte_reg = in.byte_rm = true; in.access = TYPE_RMW; in.flags_write = true; break;
+      case 0xc1: in.modrm = true; in.access = TYPE_RMW; in.flags_write = true; break;
+      case 0xc8 ... 0xcf: in.kind = Inst::EMBEDDED; break;
+      default: return false;
+      }
+
+    // modrm, sib and displacement
+    if (in.modrm) {
+      if (i >= avail) return false;
+      in.modrm_pos = i;
+      in.mod = p[i] >> 6;
+      in.reg = (p[i] >> 3) & 7;
+      in.rm  = p[i++] & 7;
+      if (in.mod != 3) {
+	unsigned disp = in.mod == 1 ? 1 : (in.mod == 2 ? 4 : 0);
+	if (in.rm == 4) {
+	  if (i >= avail) return false;
+	  if (!in.mod && (p[i] & 7) == 5) disp = 4;
+	  i++;
+	}
+	if (!in.mod && in.rm == 5) disp = 4;
+	i += disp;
+      }
+    }
+
+    // opcode extensions
+    unsigned ext = in.reg;
+    if (group != NONE) in.reg_is_reg = false;
+    switch (group) {
+    case GROUP1:
+      in.flags_read = ext == 2 || ext == 3;
+      in.flags_write = true;
+      in.access = ext == 7 ? TYPE_R : TYPE_RMW;
+      break;
+    case SHIFT:
+      // a zero count keeps the flags
+      if (ext == 6) return false;
+      in.flags_read = ext == 2 || ext == 3;
+      in.access = TYPE_RMW;
+      break;
+    case MOVIMM:
+      if (ext) return false;
+      in.access = TYPE_W;
+      break;
+    case GROUP3:
+      if (ext >= 6) return false;
+      if (ext < 2) imm = in.byte_rm ? 1 : iz;
+      in.flags_write = ext != 2;
+      in.access = (ext == 2 || ext == 3) ? TYPE_RMW : TYPE_R;
+      break;
+    case INCDEC:
+      if (ext >= 2) return false;
+      in.access = TYPE_RMW;
+      break;
+    case GROUP8:
+      if (ext < 4) return false;
+      in.access = ext == 4 ? TYPE_R : TYPE_RMW;
+      break;
+    case REGONLY:
+      // the bit offset could address memory outside the operand
+      in.reg_is_reg = true;
+      if (in.mod != 3) return false;
+      break;
+    case SETCC:
+    case NONE:
+      break;
+    }
+    in.imm_pos = i;
+    in.imm_len = imm;
+    i += imm;
+    if (i > avail) return false;
+    in.len = i;
+    in.eip = eip;
+
+    if (in.byte_rm) in.size = 1;
+    bool mem = in.modrm && in.mod != 3;
+    if (!mem) in.access = 0;
+    if (in.kind == Inst::LEA && !mem) return false;
+    if (in.lock && (!mem || !(in.access & TYPE_W))) return false;
+
+    // branches
+    if (in.kind >= Inst::JCC) {
+      if (in.opsize) return false;
+      int rel = imm == 1 ? static_cast<signed char>(p[in.imm_pos]) : *reinterpret_cast<const int *>(p + in.imm_pos);
+      in.target = eip + in.len + rel;
+    }
+    if ((in.kind == Inst::EMBEDDED && in.twobyte) && in.opsize) return false;
+
+    // a REX prefix turns AH-BH into SPL-DIL
+    if (in.kind == Inst::NORMAL && in.modrm) {
+      bool rex = mem || (in.reg_is_reg && !in.byte_reg && in.reg == 4) || (in.mod == 3 && !in.byte_rm && in.rm == 4);
+      if (rex && ((in.reg_is_reg && in.byte_reg && in.reg >= 4) || (in.mod == 3 && in.byte_rm && in.rm >= 4))) return false;
+    }
+    return true;
+  }
+
+
+  /**
+   * Re-encode the address of a modrm operand with a new reg field.
+   * Returns the REX bits that are needed.
+   */
+  unsigned encode_address(const unsigned char *p, const Inst &in, unsigned reg, char *buf, unsigned &len)
+  {
+    unsigned rex = 0;
+    const unsigned char *disp = p + in.modrm_pos + 1;
+    len = 0;
+    if (in.rm == 4) {
+      unsigned char sib = *disp++;
+      // ESP as base is R15
+      if ((sib & 7) == 4) { sib |= 7; rex |= 1; }
+      buf[len++] = in.mod << 6 | reg << 3 | 4;
+      buf[len++] = sib;
+    }
+    else if (!in.mod && in.rm == 5) {
+      // avoid RIP-relative addressing
+      buf[len++] = reg << 3 | 4;
+      buf[len++] = 0x25;
+    }
+    else
+      buf[len++] = in.mod << 6 | reg << 3 | in.rm;
+    while (disp < p + in.imm_pos) buf[len++] = *disp++;
+    return rex;
+  }
+
+
+  /**
+   * Translate the address of a memory operand into R10 or leave to a
+   * stub on a TLB miss.
+   */
+  void emit_access(const unsigned char *p, const Inst &in, unsigned index, Fixup *fixups, unsigned &nfixups)
+  {
+    char buf[8];
+    unsigned len;
+    unsigned rex = encode_address(p, in, 2, buf, len);
+    if (in.flags_live) emit(0x9c);                               // pushfq
+    emit(0x67); emit(0x44 | rex); emit(0x8d); emit(buf, len);    // lea r10d, [addr]
+    emit("\x45\x89\xd3", 3);                                     // mov r11d, r10d
+    emit("\x41\xc1\xeb\x07", 4);                                 // shr r11d, 7
+    emit("\x41\x81\xe3", 3); emit4((TLB_ENTRIES - 1) << 5);     // and r11d, index mask
+    emit("\x4d\x01\xe3", 3);                                     // add r11, r12
+    emit("\x45\x89\xd5", 3);                                     // mov r13d, r10d
+    emit("\x41\x81\xe5", 3); emit4(~0xfffu | (in.size - 1));    // and r13d, page and alignment
+    emit("\x45\x3b\x6b", 3); emit(in.access & TYPE_W ? 4 : 0);  // cmp r13d, [r11 + tag]
+    emit("\x0f\x85", 2);                                         // jne stub
+    Fixup &f = fixups[nfixups++];
+    f.pos = _code_pos;
+    f.index = index;
+    f.eip = in.eip;
+    f.type = in.access;
+    f.live = in.flags_live;
+    emit4(0);
+    emit("\x4d\x03\x53\x08", 4);                                 // add r10, [r11 + addend]
+    if (in.flags_live) emit(0x9d);                               // popfq
+  }
+
+
+  /**
+   * Emit a non-branch instruction.
+   */
+  void emit_inst(const unsigned char *p, const Inst &in, unsigned index, Fixup *fixups, unsigned &nfixups)
+  {
+    bool mem = in.modrm && in.mod != 3;
+    switch (in.kind) {
+    case Inst::NORMAL:
+      {
+	unsigned rex = 0, reg = in.reg, rm = in.rm;
+	if (mem) {
+	  emit_access(p, in, index, fixups, nfixups);
+	  rex = 1;
+	  rm = 2;
+	}
+	else if (in.modrm && !in.byte_rm && rm == 4) { rm = 7; rex |= 1; }
+	if (in.modrm && in.reg_is_reg && !in.byte_reg && reg == 4) { reg = 7; rex |= 4; }
+	if (in.lock)   emit(0xf0);
+	if (in.opsize) emit(0x66);
+	if (rex)       emit(0x40 | rex);
+	if (in.twobyte) emit(0x0f);
+	emit(in.op);
+	if (in.modrm) emit((mem ? 0 : 0xc0) | reg << 3 | rm);
+	emit(reinterpret_cast<const char *>(p) + in.imm_pos, in.imm_len);
+
+	// bump the write generation after the store landed
+	if (mem && in.access & TYPE_W) {
+	  if (in.flags_live_out) emit(0x9c);                         // pushfq
+	  emit("\x4d\x8b\x6b\x10\xf0\x41\xff\x45\x00", 9);         // mov r13, [r11 + gen]; lock inc dword [r13]
+	  if (in.flags_live_out) emit(0x9d);                         // popfq
+	}
+      }
+      break;
+    case Inst::LEA:
+      {
+	char buf[8];
+	unsigned len, reg = in.reg, rex = 0;
+	if (reg == 4) { reg = 7; rex |= 4; }
+	rex |= encode_address(p, in, reg, buf, len);
+	emit(0x67);
+	if (in.opsize) emit(0x66);
+	if (rex) emit(0x40 | rex);
+	emit(0x8d);
+	emit(buf, len);
+      }
+      break;
+    case Inst::EMBEDDED:
+      {
+	unsigned reg = in.op & 7;
+	if (in.opsize) emit(0x66);
+	if (reg == 4) { emit(0x41); reg = 7; }
+	if (in.twobyte) emit(0x0f);
+	emit((in.op & ~7) | reg);
+	emit(reinterpret_cast<const char *>(p) + in.imm_pos, in.imm_len);
+      }
+      break;
+    case Inst::INCDEC:
+      {
+	unsigned reg = in.op & 7;
+	if (in.opsize) emit(0x66);
+	if (reg == 4) { emit(0x41); reg = 7; }
+	emit(0xff);
+	emit(0xc0 | (in.op & 8) | reg);
+      }
+      break;
+    default:
+      assert(0);
+    }
+  }
+
+
+  /**
+   * Translate a block starting at the given code.
+   */
+  char *translate(const unsigned char *page, unsigned eip)
+  {
+    Inst insts[BLOCK_INSTS];
+    unsigned n = 0;
+    unsigned offset = eip & 0xfff;
+    while (n < BLOCK_INSTS) {
+      if (!decode(page + offset, 0x1000 - offset, eip, insts[n])) break;
+      offset += insts[n].len;
+      eip += insts[n].len;
+      if (insts[n++].kind >= Inst::JCC) break;
+    }
+    if (!n) return 0;
+
+    // flags are live at the end of a block
+    bool live = true;
+    for (unsigned i = n; i--; ) {
+      insts[i].flags_live_out = live;
+      live = insts[i].flags_live = insts[i].flags_read || (live && !insts[i].flags_write);
+    }
+
+    if (_code_pos + BLOCK_INSTS * 96 + 64 > CODE_SIZE) flush_all();
+    char *res = _code + _code_pos;
+    Fixup fixups[BLOCK_INSTS];
+    unsigned nfixups = 0;
+    Inst &last = insts[n - 1];
+    unsigned body = last.kind >= Inst::JCC ? n - 1 : n;
+    for (unsigned i = 0; i < body; i++)
+      emit_inst(page + (insts[i].eip & 0xfff), insts[i], i, fixups, nfixups);
+
+    emit("\x41\xb8", 2); emit4(n << 8);                               // mov r8d, count
+    switch (last.kind) {
+    case Inst::JCC:
+      emit("\x41\xbd", 2); emit4(last.target);                        // mov r13d, target
+      emit(0x70 | (page[(last.eip & 0xfff) + last.opcode_pos] & 0xf)); emit(6);
+      emit("\x41\xbd", 2); emit4(eip);                                // mov r13d, next
+      break;
+    case Inst::JMP:
+      emit("\x41\xbd", 2); emit4(last.target);
+      break;
+    case Inst::LOOP:
+      emit("\x41\xbd", 2); emit4(eip);
+      emit("\x8d\x49\xff\x67\xe3\x06", 6);                            // lea ecx, [rcx-1]; jecxz
+      emit("\x41\xbd", 2); emit4(last.target);
+      break;
+    case Inst::JECXZ:
+      emit("\x41\xbd", 2); emit4(last.target);
+      emit("\x67\xe3\x06", 3);                                        // jecxz
+      emit("\x41\xbd", 2); emit4(eip);
+      break;
+    default:
+      emit("\x41\xbd", 2); emit4(eip);
+    }
+    emit(0xc3);
+
+    // the stubs for TLB misses
+    for (unsigned i = 0; i < nfixups; i++) {
+      unsigned rel = _code_pos - (fixups[i].pos + 4);
+      memcpy(_code + fixups[i].pos, &rel, 4);
+      if (fixups[i].live) emit(0x9d);
+      emit("\x41\xb8", 2); emit4(fixups[i].index << 8 | fixups[i].type);
+      emit("\x45\x89\xd1", 3);                                        // mov r9d, r10d
+      emit("\x41\xbd", 2); emit4(fixups[i].eip);
+      emit(0xc3);
+    }
+    COUNTER_INC("JIT blocks");
+    return res;
+  }
+
+
+  /**
+   * Generate the code that switches between host and guest state.
+   */
+  void emit_trampoline()
+  {
+    static const char code[] =
+      "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57"   // push rbx, rbp, r12-r15
+      "\x49\x89\xfe"                               // mov r14, rdi
+      "\x4d\x8b\x66\x30"                           // mov r12, [r14 + tlb]
+      "\x41\x8b\x46\x00\x41\x8b\x4e\x04\x41\x8b\x56\x08\x41\x8b\x5e\x0c"
+      "\x45\x8b\x7e\x10\x41\x8b\x6e\x14\x41\x8b\x76\x18\x41\x8b\x7e\x1c"
+      "\x41\xff\x76\x20\x9d"                       // push [r14 + efl]; popfq
+      "\x41\xff\x56\x28"                           // call [r14 + code]
+      "\x9c\x41\x5a"                               // pushfq; pop r10
+      "\x41\x89\x46\x00\x41\x89\x4e\x04\x41\x89\x56\x08\x41\x89\x5e\x0c"
+      "\x45\x89\x7e\x10\x41\x89\x6e\x14\x41\x89\x76\x18\x41\x89\x7e\x1c"
+      "\x4d\x89\x56\x20"                           // mov [r14 + efl], r10
+      "\x45\x89\x6e\x38\x45\x89\x46\x3c\x45\x89\x4e\x40"  // eip, exit, addr
+      "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b\xc3";
+    _trampoline = reinterpret_cast<void (*)(Frame *)>(_code + _code_pos);
+    emit(code, sizeof(code) - 1);
+    _code_start = _code_pos;
+  }
+
+
+  void flush_tlb()
+  {
+    for (unsigned i = 0; i < TLB_ENTRIES; i++) _jtlb[i].read = _jtlb[i].write = TAG_INVALID;
+  }
+
+
+  void flush_all()
+  {
+    COUNTER_INC("JIT flush");
+    memset(_blocks, 0, sizeof(_blocks));
+    _code_pos = _code_start;
+    _code_page_count = 0;
+    flush_tlb();
+  }
+
+
+  bool is_code_page(uintptr_t phys)
+  {
+    for (unsigned i = 0; i < _code_page_count; i++)
+      if (_code_pages[i] == phys) return true;
+    return false;
+  }
+
+
+  /**
+   * Translated code must not write to its own pages.
+   */
+  void add_code_page(uintptr_t phys)
+  {
+    if (is_code_page(phys)) return;
+    if (_code_page_count == CODE_PAGES) flush_all();
+    _code_pages[_code_page_count++] = phys;
+    for (unsigned i = 0; i < TLB_ENTRIES; i++)
+      if (_jtlb[i].phys == phys) _jtlb[i].write = TAG_INVALID;
+  }
+
+
+  /**
+   * Fill our TLB from the Halifax TLB after Halifax executed the
+   * instruction that missed.
+   */
+  void fill_tlb(unsigned virt, unsigned type)
+  {
+    TlbEntry *entry = tlb_cached(virt, user_access(Type(type)));
+    if (!entry || !entry->_ptr) return;
+    unsigned page = virt & ~0xfffu;
+    JitTlb &t = _jtlb[(virt >> 12) % TLB_ENTRIES];
+    t.read   = user_access(TYPE_R) & ~entry->_rights ? unsigned(TAG_INVALID) : page;
+    t.write  = user_access(TYPE_W) & ~entry->_rights || is_code_page(entry->_phys) ? unsigned(TAG_INVALID) : page;
+    t.addend = entry->_ptr - page;
+    t.gen    = entry->_gen ? entry->_gen : &_dummy_gen;
+    t.phys   = entry->_phys;
+  }
+
+
+  /**
+   * Is the CPU in flat 32-bit protected mode?
+   */
+  bool flat()
+  {
+    if (!_cpu->pm() || _cpu->efl & ((1 << 17) | (1 << 8)) || ~_cpu->cs.ar & 0x400) return false;
+    CpuState::Descriptor *segs[] = { &_cpu->cs, &_cpu->ds, &_cpu->es, &_cpu->ss };
+    for (unsigned i = 0; i < 4; i++)
+      if (segs[i]->base || segs[i]->limit != ~0u || (i && (segs[i]->ar & 0x9e) != 0x92)) return false;
+    return true;
+  }
+
+
+  Block *find_block(unsigned eip, unsigned cs_ar)
+  {
+    Block &b = _blocks[(eip ^ (eip >> 10)) % BLOCKS];
+    if (b.linear == eip && b.cs_ar == cs_ar && b.gen && *b.gen == b.gen_value) return &b;
+
+    // we translate only code that Halifax has already fetched
+    TlbEntry *entry = tlb_cached(eip, user_access(Type(TYPE_X | TYPE_R)));
+    if (!entry || !entry->_ptr || !entry->_gen) return 0;
+    add_code_page(entry->_phys);
+    b.linear    = eip;
+    b.cs_ar     = cs_ar;
+    b.gen       = entry->_gen;
+    b.gen_value = *entry->_gen;
+    Cpu::barrier();
+    b.code      = translate(reinterpret_cast<unsigned char *>(entry->_ptr), eip);
+    return &b;
+  }
+
+
+  /**
+   * Run translated blocks.  Returns the number of executed
+   * instructions or 0 if Halifax should execute the next one.
+   */
+  unsigned run(unsigned budget)
+  {
+    if (!flat()) return 0;
+    if (_jtlb_gen != _tlb_gen) {
+      flush_all();
+      _jtlb_gen = _tlb_gen;
+    }
+    if (_jtlb_cpl != _cpu->cpl()) {
+      flush_tlb();
+      _jtlb_cpl = _cpu->cpl();
+    }
+    if (_miss_type) {
+      if (!_miss_seen) { _miss_seen = true; return 0; }
+      fill_tlb(_miss_addr, _miss_type);
+      _miss_type = 0;
+    }
+
+    Frame frame;
+    for (unsigned i = 0; i < 8; i++) frame.gpr[i] = _cpu->gpr[i];
+    frame.efl = (_cpu->efl & ARITH_FLAGS) | 2;
+    frame.tlb = _jtlb;
+    frame.eip = _cpu->eip;
+    unsigned n = 0;
+    while (n < budget) {
+      Block *b = find_block(frame.eip, _cpu->cs.ar);
+      if (!b || !b->code) break;
+      frame.code = b->code;
+      _trampoline(&frame);
+      n += frame.exit >> 8;
+      if (frame.exit & 0xff) {
+	COUNTER_INC("JIT miss");
+	_miss_type = frame.exit & 0xff;
+	_miss_addr = frame.addr;
+	_miss_seen = !n;
+	break;
+      }
+    }
+    if (n) {
+      for (unsigned i = 0; i < 8; i++) _cpu->gpr[i] = frame.gpr[i];
+      _cpu->efl = (_cpu->efl & ~ARITH_FLAGS) | (frame.efl & ARITH_FLAGS);
+      _cpu->eip = frame.eip;
+      _mtr_out |= MTD_RFLAGS | MTD_RSP;
+    }
+    return n;
+  }
+
+  static unsigned native(InstructionCache *cache, unsigned budget) { return static_cast<Jit *>(cache)->run(budget); }
+
+public:
+  Jit(VCpu *vcpu) : Halifax(vcpu), _code_pos(), _blocks(), _jtlb(), _jtlb_gen(), _jtlb_cpl(), _code_page_count(), _dummy_gen(), _miss_type(), _miss_addr(), _miss_seen()
+  {
+    _code = reinterpret_cast<char *>(mmap(0, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (_code == MAP_FAILED) Logging::panic("could not allocate memory for the JIT");
+    emit_trampoline();
+    flush_all();
+    _jtlb_gen = _tlb_gen;
+    _native = native;
+  }
+};
+#endif
@@ -45,12 +45,15 @@ class MemCache
 protected:
   DBus<MessageMem>       &_mem;
   DBus<MessageMemRegion> &_memregion;
+  DeviceLock            *&_device_lock;
   unsigned  _fault;
   unsigned  _error_code;
   unsigned  _debug_fault_line;
   unsigned  _mtr_in;
   unsigned  _mtr_read;
   unsigned  _mtr_out;
+  // the current instruction touched MMIO or devices and ends a batch
+  bool      _stop_batch;
 private:
   enum {
     SIZE = 64,
@@ -59,7 +62,12 @@ private:
     // Number of buffers, we need two for movs, push and similar instructions...
     BUFFERS = 6,
     // The maximum size of a buffer, the minmum is 16+dword (cmpxchg16b+instruction-reread).
-    BUFFER_SIZE = 16 + 4
+    BUFFER_SIZE = 16 + 4,
+    // The direct page table covers the first 4G of physical memory.
+    PAGES_LEAF = 1024,
+    PAGES_TOP = 1024,
+    // Pages an instruction can write, movs and push can cross pages.
+    WRITTEN = 8,
   };
 
   // the hash function for the cache
@@ -87,6 +95,8 @@ public:
     char *_ptr;
     // length of cache entry, this can be up to 8k long
     size_t _len;
+    // write generation of the first page or 0 if not tracked
+    unsigned *_gen;
     // a pointer in a single linked list to an older entry in the set or ~0u at the end
     unsigned _older;
     bool is_valid(uintptr_t phys1, uintptr_t phys2, size_t len)
@@ -104,6 +114,52 @@ private:
   } _sets[SIZE];
 
 
+  /**
+   * A lazily populated table from page numbers to host pointers.
+   * Regions are considered static, as it is already assumed by the
+   * cache sets.
+   */
+  struct PageEntry
+  {
+    // 0 -> MMIO or no memory at all
+    char *_ptr;
+    unsigned *_gen;
+    bool _valid;
+  };
+  PageEntry *_pages[PAGES_TOP];
+
+  // the entries returned for direct RAM accesses, we need two for movs
+  CacheEntry _direct[2];
+  unsigned   _direct_next;
+
+  // write generations of the pages the current instruction writes
+  unsigned  *_written[WRITTEN];
+  unsigned   _written_count;
+
+
+  /**
+   * Get the table entry of a physical page or 0 if the page is not
+   * covered by the table.
+   */
+  PageEntry *page_entry(uintptr_t page)
+  {
+    if (page >= PAGES_LEAF * PAGES_TOP) return 0;
+    PageEntry *&leaf = _pages[page / PAGES_LEAF];
+    if (!leaf) leaf = new PageEntry[PAGES_LEAF]();
+    PageEntry *res = leaf + page % PAGES_LEAF;
+    if (!res->_valid) {
+      DeviceGuard guard(_device_lock);
+      MessageMemRegion msg(page);
+      if (_memregion.send(msg, true) && msg.ptr) {
+	res->_ptr = msg.ptr + ((page - msg.start_page) << 12);
+	res->_gen = msg.gen ? msg.gen + (page - msg.start_page) : 0;
+      }
+      res->_valid = true;
+    }
+    return res;
+  }
+
+
   /**
    * Cache MMIO registers and pending writes to them.  The data is
    * sorted in two single linked lists. The usage list via
@@ -119,39 +175,61 @@ private:
   unsigned _newest_write;
 
 
-  void buffer_io(bool read, unsigned index) {
-    assert(!(_buffers[index]._len & 3));
-    assert(!(_buffers[index]._phys1 & 3));
+  /**
+   * Transfer buffered data from or to the devices.  The dwords of a
+   * page are sent as a single ranged access.
+   */
+  void buffer_io(bool read, uintptr_t phys1, uintptr_t phys2, char *data, size_t len) {
+    assert(!(len & 3));
+    assert(!(phys1 & 3));
 
-    uintptr_t address = _buffers[index]._phys1;
-    for (size_t i=0; i < _buffers[index]._len; i += 4) {
-      MessageMem msg2(read, address, reinterpret_cast<unsigned *>(_buffers[index].data + i));
+    DeviceGuard guard(_device_lock);
+    uintptr_t address = phys1;
+    for (size_t i=0; i < len; ) {
+      MessageMem msg2(read, address, reinterpret_cast<unsigned *>(data + i), MIN(len - i, 0x1000 - (address & 0xfff)) / 4);
       _mem.send(msg2, true);
-      if ((address & 0xfff) != 0xffc)
-	address += 4;
-      else
-	address = _buffers[index]._phys2;
+      // the dwords up to msg2.phys are done
+      size_t n = msg2.phys - address + 4;
+      i += n;
+      address += n;
+      if (!(address & 0xfff)) address = phys2;
     }
   }
 
 
   /**
-   * Invalidate the oldest dirty entry in the list.
+   * Invalidate the oldest dirty entry in the list.  Following writes
+   * to the directly adjunct addresses of the same page are combined
+   * into a single transaction.
    */
   void invalidate_dirty()
   {
-    unsigned i = _oldest_write;
-    assert(~i);
-
-    _oldest_write = _buffers[i]._newer_write;
-    if (_newest_write == i)
-      {
-	_newest_write = ~0;
-	assert(_oldest_write == _newest_write);
-      }
-    _buffers[i]._newer_write = ~0;
-
-    buffer_io(false, i);
+    assert(~_oldest_write);
+
+    char data[BUFFERS * BUFFER_SIZE];
+    size_t len = 0;
+    unsigned combined = 0;
+    uintptr_t phys1 = _buffers[_oldest_write]._phys1;
+    uintptr_t phys2 = _buffers[_oldest_write]._phys2;
+    do {
+      unsigned i = _oldest_write;
+      _oldest_write = _buffers[i]._newer_write;
+      if (_newest_write == i)
+	{
+	  _newest_write = ~0;
+	  assert(_oldest_write == _newest_write);
+	}
+      _buffers[i]._newer_write = ~0;
+      memcpy(data + len, _buffers[i].data, _buffers[i]._len);
+      len += _buffers[i]._len;
+      combined++;
+    } while (~_oldest_write && phys2 == ~0xffful
+	     && _buffers[_oldest_write]._phys1 == phys1 + len
+	     && _buffers[_oldest_write]._phys2 == ~0xffful
+	     && !((_buffers[_oldest_write]._phys1 ^ phys1) & ~0xffful));
+
+    if (combined > 1) COUNTER_INC("MMIO wc");
+    buffer_io(false, phys1, phys2, data, len);
   }
 
 
@@ -185,14 +263,89 @@ private:
 
 public:
 
+  /**
+   * Get a pointer to a physical page that is directly mapped or 0 if
+   * the page is MMIO.  Also returns its write generation if the
+   * region keeps track of them.
+   */
+  char *get_page(uintptr_t phys, unsigned *&gen)
+  {
+    PageEntry *page = page_entry(phys >> 12);
+    if (page) {
+      gen = page->_gen;
+      return page->_ptr;
+    }
+    DeviceGuard guard(_device_lock);
+    MessageMemRegion msg(phys >> 12);
+    gen = 0;
+    if (!_memregion.send(msg, true) || !msg.ptr) return 0;
+    if (msg.gen) gen = msg.gen + (msg.page - msg.start_page);
+    return msg.ptr + ((msg.page - msg.start_page) << 12);
+  }
+
+
   /**
    * Get an entry from the cache or fetch one from memory.
    */
   CacheEntry *get(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
+  {
+    CacheEntry *entry = fetch(phys1, phys2, len, type);
+    if (type & TYPE_W && entry->_gen) {
+      will_write(entry->_gen);
+      if (phys2 != ~0xffful) will_write(entry->_gen + 1);
+    }
+    return entry;
+  }
+
+
+  /**
+   * Remember a page the current instruction writes.  Its generation
+   * is bumped after the store, so that another vCPU that decodes the
+   * page in between does not keep the old code.
+   */
+  void will_write(unsigned *gen)
+  {
+    for (unsigned i = 0; i < _written_count; i++)
+      if (_written[i] == gen) return;
+    // earlier pages of a long string instruction are already written
+    if (_written_count == WRITTEN) bump_written();
+    _written[_written_count++] = gen;
+  }
+
+
+  /**
+   * The stores of the current instruction landed, bump the write
+   * generations of their pages.
+   */
+  void bump_written()
+  {
+    for (unsigned i = 0; i < _written_count; i++)
+      Cpu::atomic_xadd(_written[i], 1);
+    _written_count = 0;
+  }
+
+private:
+  CacheEntry *fetch(uintptr_t phys1, uintptr_t phys2, size_t len, Type type)
   {
     assert(!(phys1 & 3));
     assert(!(len & 3));
 
+    // plain RAM is found in the page table without hashing
+    PageEntry *page1 = page_entry(phys1 >> 12);
+    if (page1 && page1->_ptr) {
+      // a second page has to follow directly in the same region
+      PageEntry *page2 = phys2 != ~0xffful ? page_entry(phys2 >> 12) : 0;
+      if (phys2 == ~0xffful || (page2 && page2->_ptr == page1->_ptr + 0x1000 && (!page1->_gen || page2->_gen == page1->_gen + 1))) {
+	CacheEntry *res = _direct + (_direct_next++ & 1);
+	res->_ptr   = page1->_ptr + (phys1 & 0xfff);
+	res->_len   = len;
+	res->_phys1 = phys1;
+	res->_phys2 = phys2;
+	res->_gen   = page1->_gen;
+	return res;
+      }
+    }
+
     // XXX simplify it by relying on memory ranges
     {
       unsigned s = slot(phys1);
@@ -213,6 +366,7 @@ public:
       }
 
       // try to get a direct memory reference
+      DeviceGuard guard(_device_lock);
       MessageMemRegion msg1(phys1 >> 12);
       if (supported && _memregion.send(msg1, true) && msg1.ptr && ((phys1 + len) <= ((msg1.start_page + msg1.count) << 12))) {
 	CacheEntry *res = _sets[s]._values + entry;
@@ -220,6 +374,7 @@ public:
 	res->_len = len;
 	res->_phys1 = phys1;
 	res->_phys2 = phys2;
+	res->_gen = msg1.gen ? msg1.gen + (msg1.page - msg1.start_page) : 0;
 	return_move_to_front(_sets[s]._values, _sets[s]._newest);
       }
     }
@@ -227,6 +382,8 @@ public:
     // we could not alloc the memory region directly from RAM, thus we use our own buffer instead.
     {
       assert(len <= BUFFER_SIZE);
+      // buffered data is only valid until the next writeback
+      _stop_batch = true;
       search_entry(_buffers, _newest_buffer);
 
       /**
@@ -254,15 +411,16 @@ public:
       _buffers[entry]._len   = len;
       _buffers[entry]._phys1 = phys1;
       _buffers[entry]._phys2 = phys2;
+      _buffers[entry]._gen   = 0;
 
       // do we have to read the data into the cache?
-      if (type & TYPE_R) buffer_io(true, entry);
+      if (type & TYPE_R) buffer_io(true, phys1, phys2, _buffers[entry].data, len);
 
       return_move_to_front(_buffers, _newest_buffer);
     }
   }
 
-
+public:
   /**
    * Invalidate the cache, thus writeback the buffers.
    */
@@ -276,7 +434,7 @@ public:
     }
 
 
-  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : _mem(mem), _memregion(memregion), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), debug(false), _sets()
+  MemCache(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion, DeviceLock *&device_lock) : _mem(mem), _memregion(memregion), _device_lock(device_lock), _fault(), _error_code(), _debug_fault_line(), _mtr_in(), _mtr_read(), _mtr_out(), _stop_batch(), debug(false), _sets(), _pages(), _direct(), _direct_next(), _written(), _written_count()
   {
     assert(ASSOZ   >= 2);
     assert(BUFFERS >= 2);
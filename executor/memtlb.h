@@ -34,6 +34,40 @@ private:
   unsigned long _msr_efer;
   unsigned _paging_mode;
 
+  enum {
+    TLB_SIZE  = 64,
+    TLB_ASSOZ = 4,
+  };
+
+protected:
+  /**
+   * A cached translation of a virtual page.
+   */
+  struct TlbEntry
+  {
+    // the virtual and physical page addresses
+    uintptr_t _virt;
+    uintptr_t _phys;
+    // pointer to the page if it is RAM or 0 for MMIO
+    char     *_ptr;
+    // write generation of the page or 0 if not tracked
+    unsigned *_gen;
+    // access rights of the translation, 0 -> invalid
+    unsigned  _rights;
+    // size of the page as in the pagetables
+    unsigned  _size;
+  };
+
+private:
+  TlbEntry _tlb[TLB_SIZE * TLB_ASSOZ];
+  unsigned _tlb_pos;
+  mword    _tlb_cr3;
+protected:
+  // incremented on every flush, so that derived translations can be revalidated
+  unsigned _tlb_gen;
+private:
+  unsigned tlb_slot(uintptr_t virt) { virt >>= 12; return ((virt ^ (virt / TLB_SIZE)) % TLB_SIZE) * TLB_ASSOZ; }
+
   enum Features {
     FEATURE_PSE        = 1 << 0,
     FEATURE_PSE36      = 1 << 1,
@@ -41,7 +75,7 @@ private:
     FEATURE_SMALL_PDPT = 1 << 3,
     FEATURE_LONG       = 1 << 4,
   };
-  unsigned (*tlb_fill_func)(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys);
+  unsigned (*tlb_fill_func)(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys, unsigned &rights, unsigned &size);
 
 #define AD_ASSIST(bits)							\
   if ((pte & (bits)) != (bits))						\
@@ -54,18 +88,18 @@ private:
     }
 
   template <unsigned features, typename PTE_TYPE>
-    static unsigned tlb_fill(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys)
-  {  return tlb->tlb_fill2<features, PTE_TYPE>(virt, type, phys); }
+    static unsigned tlb_fill(MemTlb *tlb, uintptr_t virt, unsigned type, uintptr_t &phys, unsigned &rights, unsigned &size)
+  {  return tlb->tlb_fill2<features, PTE_TYPE>(virt, type, phys, rights, size); }
 
 
   template <unsigned features, typename PTE_TYPE>
-    unsigned tlb_fill2(uintptr_t virt, unsigned type, uintptr_t &phys)
+    unsigned tlb_fill2(uintptr_t virt, unsigned type, uintptr_t &phys, unsigned &rights, unsigned &size)
   {
     PTE_TYPE pte;
     if (features & FEATURE_SMALL_PDPT) pte = _pdpt[(virt >> 30) & 3]; else pte = READ(cr3);
     if (features & FEATURE_SMALL_PDPT && ~pte & 1) PF(virt, type & ~1);
     if (~features & FEATURE_PAE || ~_paging_mode & (1<<11)) type &= ~TYPE_X;
-    unsigned rights = TYPE_R | TYPE_W | TYPE_U | TYPE_X;
+    rights = TYPE_R | TYPE_W | TYPE_U | TYPE_X;
     unsigned l = features & FEATURE_LONG ? 4 : 2;
     bool is_sp;
     CacheEntry *entry = 0;
@@ -106,7 +140,7 @@ private:
     // update A+D bits
     AD_ASSIST((rights & 3) << 5);
 
-    unsigned size = ((features & FEATURE_PAE) ? 9 : 10) * l + 12;
+    size = ((features & FEATURE_PAE) ? 9 : 10) * l + 12;
     if (features & FEATURE_PSE36 && is_sp)
       phys = ((pte >> 22) | ((pte & 0x1fe000) >> 2));
     else
@@ -115,26 +149,79 @@ private:
     return _fault;
   }
 
-  int virt_to_phys(uintptr_t virt, Type type, uintptr_t &phys) {
+  int virt_to_phys(uintptr_t virt, Type type, uintptr_t &phys, unsigned &rights, unsigned &size) {
 
-    if (tlb_fill_func) return tlb_fill_func(this, virt, type, phys);
+    if (tlb_fill_func) return tlb_fill_func(this, virt, type, phys, rights, size);
     phys = virt;
+    rights = TYPE_R | TYPE_W | TYPE_U | TYPE_X;
+    size = 12;
     return _fault;
   }
 
+  /**
+   * Translate a virtual address through the TLB and fill it on a
+   * miss by walking the pagetables.  Returns 0 on a fault.
+   */
+  TlbEntry *tlb_lookup(uintptr_t virt, Type type) {
+
+    uintptr_t page = virt & ~0xffful;
+    unsigned s = tlb_slot(page);
+    unsigned index = s + (_tlb_pos++ % TLB_ASSOZ);
+    for (unsigned i = s; i < s + TLB_ASSOZ; i++)
+      if (_tlb[i]._rights && _tlb[i]._virt == page)
+	{
+	  if (!(type & ~_tlb[i]._rights)) {
+	    COUNTER_INC("TLB hit");
+	    return _tlb + i;
+	  }
+	  // not enough rights cached, e.g. first write to a page -> refill this entry
+	  index = i;
+	  break;
+	}
+
+    COUNTER_INC("TLB miss");
+    uintptr_t phys;
+    unsigned rights, size;
+    _tlb[index]._rights = 0;
+    if (virt_to_phys(virt, type, phys, rights, size)) return 0;
+
+    TlbEntry *entry = _tlb + index;
+    entry->_virt   = page;
+    entry->_phys   = phys & ~0xffful;
+    entry->_ptr    = get_page(entry->_phys, entry->_gen);
+    entry->_size   = size;
+    entry->_rights = rights;
+    return entry;
+  }
+
   /**
    * Find a CacheEntry to a virtual memory access.
    */
   CacheEntry *find_virtual(uintptr_t virt, size_t len, Type type) {
 
-    uintptr_t phys1, phys2;
-    if (!virt_to_phys(virt, type, phys1)) {
-      if (!((virt ^ (virt + len - 1)) & ~0xfff)) phys2 = ~0ul;
-      else
-	if (virt_to_phys(virt + len - 1, type, phys2)) return 0;
-      return get(phys1, phys2 & ~0xffful, len, type);
+    TlbEntry *entry;
+    uintptr_t phys1, phys2 = ~0ul;
+    if (!(entry = tlb_lookup(virt, type))) return 0;
+    phys1 = entry->_phys | (virt & 0xfff);
+    if ((virt ^ (virt + len - 1)) & ~0xfff) {
+      if (!(entry = tlb_lookup(virt + len - 1, type))) return 0;
+      phys2 = entry->_phys;
     }
-    return 0;
+    return get(phys1, phys2 & ~0xffful, len, type);
+  }
+
+
+  /**
+   * Get a direct pointer for an access that does not cross a RAM
+   * page. Returns 0 if the access needs to go through the cache.
+   */
+  char *find_direct(uintptr_t virt, size_t len, Type type) {
+
+    if ((virt ^ (virt + len - 1)) & ~0xfff) return 0;
+    TlbEntry *entry = tlb_lookup(virt, type);
+    if (!entry || !entry->_ptr) return 0;
+    if (type & TYPE_W && entry->_gen) will_write(entry->_gen);
+    return entry->_ptr + (virt & 0xfff);
   }
 
 protected:
@@ -144,9 +231,61 @@ protected:
   }
 
 
+  /**
+   * Lookup a cached translation with enough rights without walking
+   * the pagetables.
+   */
+  TlbEntry *tlb_cached(uintptr_t virt, Type type) {
+    uintptr_t page = virt & ~0xffful;
+    for (unsigned i = tlb_slot(page); i < tlb_slot(page) + TLB_ASSOZ; i++)
+      if (_tlb[i]._rights && _tlb[i]._virt == page && !(type & ~_tlb[i]._rights))
+	return _tlb + i;
+    return 0;
+  }
+
+
+  /**
+   * Get the write generation of the page of already fetched code or 0
+   * if it is not tracked.
+   */
+  unsigned *code_gen(uintptr_t virt) {
+    TlbEntry *entry = tlb_lookup(virt, user_access(Type(TYPE_X | TYPE_R)));
+    return entry ? entry->_gen : 0;
+  }
+
+
+  /**
+   * Flush all translations, e.g. on a CR3 write.
+   */
+  void tlb_flush() {
+    COUNTER_INC("TLB flush");
+    _tlb_gen++;
+    for (unsigned i = 0; i < TLB_SIZE * TLB_ASSOZ; i++)
+      _tlb[i]._rights = 0;
+  }
+
+
+  /**
+   * Flush the translations of a single page, e.g. on INVLPG.
+   */
+  void tlb_flush_page(uintptr_t virt) {
+    COUNTER_INC("TLB invlpg");
+    _tlb_gen++;
+    // entries of large pages are cached per 4k page
+    for (unsigned i = 0; i < TLB_SIZE * TLB_ASSOZ; i++)
+      if (!((_tlb[i]._virt ^ virt) >> _tlb[i]._size))
+	_tlb[i]._rights = 0;
+  }
+
+
   int init() {
 
-    _paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0x30 | _msr_efer & 0xc00;
+    unsigned old_mode = _paging_mode;
+    _paging_mode = (READ(cr0) & 0x80010000) | READ(cr4) & 0xb0 | _msr_efer & 0xc00;
+    if (old_mode != _paging_mode || _tlb_cr3 != READ(cr3)) {
+      tlb_flush();
+      _tlb_cr3 = READ(cr3);
+    }
 
     // fetch pdpts in leagacy PAE mode
     if ((_paging_mode & 0x80000420) == 0x80000020)
@@ -183,6 +322,12 @@ protected:
   int read_code(uintptr_t virt, size_t len, void *buffer)
   {
     assert(len < 16);
+    char *ptr = find_direct(virt, len, user_access(Type(TYPE_X | TYPE_R)));
+    if (ptr) {
+      memcpy(buffer, ptr, len);
+      return _fault;
+    }
+    if (_fault) return _fault;
     CacheEntry *entry = find_virtual(virt & ~3, (len + (virt & 3) + 3) & ~3ul, user_access(Type(TYPE_X | TYPE_R)));
     if (entry) {
       assert(len <= entry->_len);
@@ -197,6 +342,7 @@ protected:
 
   int prepare_virtual(uintptr_t virt, size_t len, Type type, void *&ptr)
   {
+    if ((ptr = find_direct(virt, len, type)) || _fault) return _fault;
     bool round = (virt | len) & 3;
     CacheEntry *entry = find_virtual(virt & ~3ul, (len + (virt & 3) + 3) & ~3ul, round ? Type(type | TYPE_R) : type);
     if (entry) {
@@ -207,5 +353,5 @@ protected:
   }
 
 
-  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion) : MemCache(mem, memregion), _cpu(), _pdpt(), _msr_efer(), _paging_mode(), tlb_fill_func() {}
+  MemTlb(DBus<MessageMem> &mem, DBus<MessageMemRegion> &memregion, DeviceLock *&device_lock) : MemCache(mem, memregion, device_lock), _cpu(), _pdpt(), _msr_efer(), _paging_mode(), _tlb(), _tlb_pos(), _tlb_cr3(), _tlb_gen(), tlb_fill_func() {}
 };
@@ -108,6 +108,9 @@ class VirtualBiosDisk : public StaticReceiver<VirtualBiosDisk>, public BiosCommo
     msg.cpu->esp -= sizeof(frame);
     copy_out(msg.cpu->esp, frame, sizeof(frame));
 
+    // disk_op() only sets AH on an error
+    msg.cpu->ah = 0;
+    msg.mtr_out |= MTD_GPR_ACDB;
     if (!disk_op(msg, 0, 0, 0x7c00, 1, false) || msg.cpu->ah)
       Logging::panic("VB: could not read MBR from boot disk");
     msg.mtr_out |= MTD_CS_SS | MTD_RIP_LEN | MTD_RSP | MTD_RFLAGS | MTD_GPR_ACDB;
@@ -154,6 +154,8 @@ private:
     m->flags |= MBI_FLAG_MMAP | MBI_FLAG_MEM;
     memcpy(physmem + m->mmap_addr, mymap, m->mmap_length);
 
+    // we wrote the modules directly into guest memory
+    _mb.mark_written(0, memsize);
     return mbi;
   };
 
@@ -27,9 +27,17 @@ public:
 
   enum {
     RESET_VECTOR = 0x100,
-    MAX_VECTOR
+    MAX_VECTOR,
+    BIOS_BASE = 0xf0000
   };
 
+  /**
+   * Does the CPU enter a vector that the VBios hooks?
+   */
+  static bool hooked_vector(CpuState *cpu) {
+    return !(cpu->pm() && !cpu->v86()) && in_range(cpu->cs.base + cpu->eip, BIOS_BASE, MAX_VECTOR);
+  }
+
 protected:
 #include "model/simplemem.h"
 
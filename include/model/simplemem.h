@@ -29,8 +29,12 @@ bool copy_inout(uintptr_t address, void *ptr, size_t count, bool read)
   if (!_bus_memregion->send(msg) || !msg.ptr || ((address + count) > ((msg.start_page + msg.count) << 12))) return false;
   if (read)
     memcpy(ptr, msg.ptr + (address - (msg.start_page << 12)), count);
-  else
+  else {
     memcpy(msg.ptr + (address - (msg.start_page << 12)), ptr, count);
+    if (msg.gen)
+      for (uintptr_t page = address >> 12; page <= (address + count - 1) >> 12; page++)
+	msg.gen[page - msg.start_page]++;
+  }
   return true;
 }
 
@@ -34,6 +34,23 @@ public:
 };
 
 
+/**
+ * Get the address a message targets, e.g. a page or an ioport.
+ * Message types that can be dispatched via the ranges registered on a
+ * bus provide an overload.
+ */
+template <class M>
+static inline bool bus_address(M &msg, uintptr_t &address) { return false; }
+
+
+/**
+ * Get the key that selects the responder of a message, e.g. a disk
+ * or timer number.  Exclusive buses remember the responder per key.
+ */
+template <class M>
+static inline bool bus_key(M &msg, uintptr_t &key) { return false; }
+
+
 /**
  * A bus is a way to connect devices.
  */
@@ -45,13 +62,55 @@ class DBus
   {
     Device *_dev;
     ReceiveFunction _func;
+    // number of address ranges claimed by the device
+    unsigned _ranges;
+    // number of messages accepted on an exclusive bus
+    unsigned long _accepted;
   };
 
-  unsigned long _debug_counter;
+  struct Range
+  {
+    unsigned  _pos;
+    uintptr_t _start;
+    uintptr_t _count;
+  };
+
+  enum {
+    // the index covers the pages of the first 4G and all ioports
+    INDEX_LEAF = 1024,
+    INDEX_TOP  = 1024,
+    // more than one range covers the address
+    INDEX_MULTI = 1u << 31,
+    MEMO_SIZE = 16,
+  };
+
+  struct Memo
+  {
+    uintptr_t _key;
+    // position + 1 of the device that accepted the key
+    unsigned  _pos;
+  };
+
+  unsigned long _sends;
+  // sends that were dispatched via the index or the responder cache
+  unsigned long _hits;
   unsigned _list_count;
   unsigned _list_size;
   struct Entry *_list;
 
+  // the positions of devices without ranges in ascending order
+  unsigned _plain_count;
+  unsigned *_plain;
+
+  unsigned _range_count;
+  Range *_ranges;
+
+  // address -> 0 for not looked up, 1 for no range, position + 2 otherwise
+  unsigned **_index;
+
+  // the responder cache of an exclusive bus
+  Memo *_memo;
+
   /**
    * To avoid bugs we disallow the copy constuctor.
    */
@@ -65,6 +124,133 @@ class DBus
     _list = n;
     _list_size = new_size;
   };
+
+  /**
+   * Forget all cached lookups, as a range has changed.
+   */
+  void flush_index()
+  {
+    if (!_index) return;
+    for (unsigned i=0; i < INDEX_TOP; i++)
+      if (_index[i]) memset(_index[i], 0, INDEX_LEAF * sizeof(**_index));
+  }
+
+
+  bool covers(unsigned pos, uintptr_t address)
+  {
+    for (unsigned i=0; i < _range_count; i++)
+      if (_ranges[i]._pos == pos && address - _ranges[i]._start < _ranges[i]._count)  return true;
+    return false;
+  }
+
+
+  /**
+   * Find the last added device with a range that covers the address
+   * and whether the ranges of other devices cover it as well.
+   */
+  unsigned lookup(uintptr_t address, bool &multi)
+  {
+    unsigned *slot = 0;
+    if (address < INDEX_LEAF * INDEX_TOP) {
+      unsigned *&leaf = _index[address / INDEX_LEAF];
+      if (!leaf) leaf = new unsigned[INDEX_LEAF]();
+      slot = leaf + address % INDEX_LEAF;
+      if (*slot) {
+	_hits++;
+	multi = *slot & INDEX_MULTI;
+	return (*slot & ~INDEX_MULTI) - 2;
+      }
+    }
+
+    unsigned res = ~0u;
+    multi = false;
+    for (unsigned i=0; i < _range_count; i++)
+      if (address - _ranges[i]._start < _ranges[i]._count && _ranges[i]._pos != res) {
+	multi = ~res;
+	if (!~res || _ranges[i]._pos > res) res = _ranges[i]._pos;
+      }
+    if (slot) *slot = (res + 2) | (multi ? unsigned(INDEX_MULTI) : 0);
+    return res;
+  }
+
+
+  /**
+   * Send a message in LIFO order, whereby devices with ranges only
+   * get messages to their addresses.
+   */
+  bool send_ranged(M &msg, uintptr_t address, bool earlyout)
+  {
+    bool multi;
+    unsigned pos = lookup(address, multi);
+
+    // devices without ranges that were added later come first
+    bool res = false;
+    unsigned i = _plain_count;
+    for (; i && (!~pos || _plain[i - 1] > pos) && !(earlyout && res); i--)
+      res |= _list[_plain[i - 1]]._func(_list[_plain[i - 1]]._dev, msg);
+    if (!~pos || (earlyout && res)) return res;
+    res |= _list[pos]._func(_list[pos]._dev, msg);
+
+    // continue with the ones before it
+    if (!multi)
+      for (; i && !(earlyout && res); i--)
+	res |= _list[_plain[i - 1]]._func(_list[_plain[i - 1]]._dev, msg);
+    else
+      while (pos-- && !(earlyout && res))
+	if (!_list[pos]._ranges || covers(pos, address))
+	  res |= _list[pos]._func(_list[pos]._dev, msg);
+    return res;
+  }
+
+
+  /**
+   * Send a message on an exclusive bus to the first device that
+   * accepts it.  Devices that accept often move to the front.
+   * Returns the position of the device or ~0u.
+   */
+  unsigned send_exclusive(M &msg, unsigned skip)
+  {
+    for (unsigned i = _list_count; i--;) {
+      if (i == skip || !_list[i]._func(_list[i]._dev, msg)) continue;
+      _list[i]._accepted++;
+
+      // ranges and the plain list refer to positions, thus keep them
+      if (_range_count || i + 1 == _list_count || _list[i]._accepted <= _list[i + 1]._accepted) return i;
+      Entry e = _list[i];
+      _list[i] = _list[i + 1];
+      _list[i + 1] = e;
+      memset(_memo, 0, MEMO_SIZE * sizeof(*_memo));
+      return i + 1;
+    }
+    return ~0u;
+  }
+
+
+  /**
+   * Try the device that accepted the key last time, before searching
+   * the whole bus.
+   */
+  bool send_memo(M &msg, uintptr_t key)
+  {
+    Memo *m = _memo + key % MEMO_SIZE;
+    unsigned skip = ~0u;
+    if (m->_pos && m->_key == key) {
+      skip = m->_pos - 1;
+      if (_list[skip]._func(_list[skip]._dev, msg)) {
+	_list[skip]._accepted++;
+	_hits++;
+	return true;
+      }
+    }
+
+    unsigned pos = send_exclusive(msg, skip);
+    if (!~pos) return false;
+    m = _memo + key % MEMO_SIZE;
+    m->_key = key;
+    m->_pos = pos + 1;
+    return true;
+  }
+
 public:
 
   void add(Device *dev, ReceiveFunction func)
@@ -73,15 +259,88 @@ public:
       set_size(_list_size > 0 ? _list_size * 2 : 1);
     _list[_list_count]._dev    = dev;
     _list[_list_count]._func = func;
-    _list_count++;
+    _list[_list_count]._ranges = 0;
+    _list[_list_count]._accepted = 0;
+
+    unsigned *n = new unsigned[_plain_count + 1];
+    memcpy(n, _plain, _plain_count * sizeof(*_plain));
+    delete [] _plain;
+    _plain = n;
+    _plain[_plain_count++] = _list_count++;
+  }
+
+
+  /**
+   * Let an already added device claim a range of addresses, i.e. pages
+   * or ioports.  Afterwards it gets messages with an address only if
+   * they hit one of its ranges, which are dispatched via an index
+   * instead of walking the whole list.  Returns a handle to move the
+   * range later.
+   */
+  unsigned add_range(Device *dev, uintptr_t start, uintptr_t count)
+  {
+    unsigned pos = _list_count;
+    while (pos-- && _list[pos]._dev != dev) {}
+    if (!~pos) Logging::panic("%s device not on the bus", __func__);
+
+    if (!_list[pos]._ranges++) {
+      unsigned i = 0;
+      while (_plain[i] != pos) i++;
+      memmove(_plain + i, _plain + i + 1, (--_plain_count - i) * sizeof(*_plain));
+    }
+
+    Range *n = new Range[_range_count + 1];
+    memcpy(n, _ranges, _range_count * sizeof(*_ranges));
+    delete [] _ranges;
+    _ranges = n;
+    _ranges[_range_count]._pos   = pos;
+    _ranges[_range_count]._start = start;
+    _ranges[_range_count]._count = count;
+
+    if (!_index) _index = new unsigned *[INDEX_TOP]();
+    flush_index();
+    return _range_count++;
   }
 
+
+  /**
+   * Move a range, e.g. when a PCI BAR is reprogrammed.  An empty
+   * range disables it.
+   */
+  void move_range(unsigned handle, uintptr_t start, uintptr_t count)
+  {
+    assert(handle < _range_count);
+    _ranges[handle]._start = start;
+    _ranges[handle]._count = count;
+    flush_index();
+  }
+
+
+  /**
+   * Declare that at most one device accepts a message, so that every
+   * send can stop at the first one.  This lets the bus remember the
+   * device that accepted a key and reorder the devices by the number
+   * of messages they accepted.
+   */
+  void set_exclusive()
+  {
+    if (!_memo) _memo = new Memo[MEMO_SIZE]();
+  }
+
+
   /**
    * Send message LIFO.
    */
   bool  send(M &msg, bool earlyout = false)
   {
-    _debug_counter++;
+    _sends++;
+    uintptr_t address;
+    if (_range_count && bus_address(msg, address)) return send_ranged(msg, address, earlyout);
+    if (_memo) {
+      uintptr_t key;
+      if (bus_key(msg, key)) return send_memo(msg, key);
+      return ~send_exclusive(msg, ~0u);
+    }
     bool res = false;
     for (unsigned i = _list_count; i-- && !(earlyout && res);)
       res |= _list[i]._func(_list[i]._dev, msg);
@@ -93,7 +352,7 @@ public:
    */
   bool  send_fifo(M &msg)
   {
-    _debug_counter++;
+    _sends++;
     bool res = false;
     for (unsigned i = 0; i < _list_count; i++)
       res |= _list[i]._func(_list[i]._dev, msg);
@@ -107,7 +366,7 @@ public:
    */
   bool  send_rr(M &msg, unsigned &start)
   {
-    _debug_counter++;
+    _sends++;
     for (unsigned i = 0; i < _list_count; i++)
       if (_list[i]._func(_list[(i + start) % _list_count]._dev, msg)) {
 	start = (i + start + 1) % _list_count;
@@ -128,15 +387,15 @@ public:
    */
   void debug_dump()
   {
-    Logging::printf("%s: Bus used %ld times.", __PRETTY_FUNCTION__, _debug_counter);
+    Logging::printf("%s: Bus used %ld times, %ld hits.", __PRETTY_FUNCTION__, _sends, _hits);
     for (unsigned i = 0; i < _list_count; i++)
       {
-	Logging::printf("\n%2d:\t", i);
+	Logging::printf("\n%2d:\t%8ld", i, _list[i]._accepted);
 	_list[i]._dev->debug_dump();
       }
     Logging::printf("\n");
   }
 
   /** Default constructor. */
-  DBus() : _debug_counter(0), _list_count(0), _list_size(0), _list(nullptr) {}
+  DBus() : _sends(0), _hits(0), _list_count(0), _list_size(0), _list(nullptr), _plain_count(0), _plain(nullptr), _range_count(0), _ranges(nullptr), _index(nullptr), _memo(nullptr) {}
 };
@@ -51,6 +51,15 @@ struct MessageHwIOIn : public MessageIOIn {
   MessageHwIOIn(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOIn(_type, _port, _count, _ptr) {}
 };
 
+/**
+ * A string in() from an ioport, e.g. REP INS.  A device reads as many
+ * elements as it can to ptr and advances ptr and count accordingly.
+ * The remaining elements are read one by one.
+ */
+struct MessageIOInString : public MessageIOIn {
+  MessageIOInString(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOIn(_type, _port, _count, _ptr) {}
+};
+
 
 /**
  * An out() to an ioport.
@@ -76,6 +85,23 @@ struct MessageHwIOOut : public MessageIOOut {
   MessageHwIOOut(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOOut(_type, _port, _count, _ptr) {}
 };
 
+/**
+ * A string out() to an ioport, e.g. REP OUTS.  Same protocol as
+ * MessageIOInString.
+ */
+struct MessageIOOutString : public MessageIOOut {
+  MessageIOOutString(Type _type, unsigned short _port, unsigned _count, void *_ptr) : MessageIOOut(_type, _port, _count, _ptr) {}
+};
+
+/**
+ * IOIO messages are dispatched by their first port, thus a device
+ * claiming ports should not expect wider accesses that start below.
+ */
+static inline bool bus_address(MessageIOIn &msg, uintptr_t &address)        { address = msg.port; return true; }
+static inline bool bus_address(MessageIOOut &msg, uintptr_t &address)       { address = msg.port; return true; }
+static inline bool bus_address(MessageIOInString &msg, uintptr_t &address)  { address = msg.port; return true; }
+static inline bool bus_address(MessageIOOutString &msg, uintptr_t &address) { address = msg.port; return true; }
+
 
 /****************************************************/
 /* Memory messages                                  */
@@ -83,6 +109,11 @@ struct MessageHwIOOut : public MessageIOOut {
 
 /**
  * A dword aligned memory access.
+ *
+ * A ranged access covers count dwords at ptr inside a single page.
+ * Devices that support it handle further dwords after the first one
+ * and advance phys, ptr and count to the last dword they handled.
+ * All other devices handle only the first dword.
  */
 struct MessageMem
 {
@@ -94,9 +125,13 @@ struct MessageMem
   bool read;
   uintptr_t phys;
   unsigned *ptr;
-  MessageMem(bool _read, uintptr_t _phys, unsigned *_ptr) : read(_read), phys(_phys), ptr(_ptr) {}
+  unsigned count;
+  MessageMem(bool _read, uintptr_t _phys, unsigned *_ptr, unsigned _count = 1) : read(_read), phys(_phys), ptr(_ptr), count(_count) {}
+  void advance(unsigned n) { phys += n * 4; ptr += n; count -= n; }
 };
 
+static inline bool bus_address(MessageMem &msg, uintptr_t &address) { address = msg.phys >> 12; return true; }
+
 /**
  * Request a region that is directly mapped into our memory.  Used for
  * mapping it to the user and optimizing internal access.
@@ -110,9 +145,12 @@ struct MessageMemRegion
   uintptr_t start_page;
   unsigned      count;
   char *        ptr;
-  MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0) {}
+  unsigned *    gen;  ///< optional write generation per page, indexed like ptr
+  MessageMemRegion(uintptr_t _page) : page(_page), count(0), ptr(0), gen(0) {}
 };
 
+static inline bool bus_address(MessageMemRegion &msg, uintptr_t &address) { address = msg.page; return true; }
+
 
 /****************************************************/
 /* PCI messages                                     */
@@ -140,6 +178,8 @@ struct MessagePciConfig
   MessagePciConfig(unsigned _bdf) : type(TYPE_PTR), bdf(_bdf), dword(0), ptr(NULL) {}
 };
 
+static inline bool bus_key(MessagePciConfig &msg, uintptr_t &key) { key = msg.bdf; return true; }
+
 struct MessageHwPciConfig : public MessagePciConfig {
   MessageHwPciConfig(unsigned _bdf, unsigned _dword) : MessagePciConfig(_bdf, _dword) {}
   MessageHwPciConfig(unsigned _bdf, unsigned _dword, unsigned _value) : MessagePciConfig(_bdf, _dword, _value) {}
@@ -274,6 +314,8 @@ struct MessagePit
   MessagePit(Type _type, unsigned _pit, bool _value=false) : type(_type), pit(_pit), value(_value) {}
 };
 
+static inline bool bus_key(MessagePit &msg, uintptr_t &key) { key = msg.pit; return true; }
+
 
 /****************************************************/
 /* Keyboard and Serial messages                     */
@@ -634,9 +676,11 @@ struct MessageDisk
   MessageDisk(unsigned _disknr, DiskParameter *_params) : type(DISK_GET_PARAMS), disknr(_disknr), params(_params), error(DISK_OK) {}
   MessageDisk(Type _type, unsigned _disknr, unsigned long _usertag, unsigned long long _sector,
               unsigned _dmacount, DmaDescriptor *_dma, unsigned long _physoffset, unsigned long _physsize)
-    : type(_type), disknr(_disknr), sector(_sector), usertag(_usertag), dmacount(_dmacount), dma(_dma), physoffset(_physoffset), physsize(_physsize) {}
+    : type(_type), disknr(_disknr), sector(_sector), usertag(_usertag), dmacount(_dmacount), dma(_dma), physoffset(_physoffset), physsize(_physsize), error(DISK_OK) {}
 };
 
+static inline bool bus_key(MessageDisk &msg, uintptr_t &key) { key = msg.disknr; return true; }
+
 
 /**
  * A disk.request is completed.
@@ -704,6 +748,8 @@ struct MessageTimeout
   MessageTimeout(unsigned  _nr, timevalue _time) : nr(_nr), time(_time) {}
 };
 
+static inline bool bus_key(MessageTimeout &msg, uintptr_t &key) { key = msg.nr; return true; }
+
 
 /**
  * Returns the wall clock time in microseconds.
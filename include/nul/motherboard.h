@@ -58,8 +58,10 @@ class Motherboard
   DBus<MessageHostOp>       bus_hostop;
   DBus<MessageHwIOIn>       bus_hwioin;	    ///< HW I/O space reads
   DBus<MessageIOIn>         bus_ioin;       ///< I/O space reads from virtual machines
+  DBus<MessageIOInString>   bus_ioinstring; ///< String I/O space reads, optional for devices
   DBus<MessageHwIOOut>      bus_hwioout;    ///< HW I/O space writes
   DBus<MessageIOOut>        bus_ioout;	    ///< I/O space writes from virtual machines
+  DBus<MessageIOOutString>  bus_iooutstring;///< String I/O space writes, optional for devices
   DBus<MessageInput>        bus_input;
   DBus<MessageIrq>          bus_hostirq;    ///< Host IRQs
   DBus<MessageIrqLines>	    bus_irqlines;   ///< Virtual IRQs before they reach (virtual) IRQ controller
@@ -126,6 +128,22 @@ class Motherboard
     Logging::printf("Ignored parameter: '%.*s'\n", (int)arglen, current);
   }
 
+  /**
+   * Bump the write generations of guest memory that was modified
+   * directly, e.g. by host DMA, so that cached code is revalidated.
+   */
+  void mark_written(uintptr_t phys, size_t len)
+  {
+    uintptr_t page = phys >> 12;
+    uintptr_t end  = (phys + len + 0xfff) >> 12;
+    while (page < end) {
+      MessageMemRegion msg(page);
+      if (!bus_memregion.send(msg, true) || !msg.gen) { page++; continue; }
+      for (; page < end && page < msg.start_page + msg.count; page++)
+	msg.gen[page - msg.start_page]++;
+    }
+  }
+
   /**
    * Dump the profiling counters.
    */
@@ -150,5 +168,12 @@ class Motherboard
       }
   }
 
-  Motherboard(Clock *__clock, Hip *__hip) : _clock(__clock), _hip(__hip), last_vcpu(0)  {}
+  Motherboard(Clock *__clock, Hip *__hip) : _clock(__clock), _hip(__hip), last_vcpu(0)
+  {
+    // a disk, PCI function, PIT or timer is served by a single device
+    bus_disk.set_exclusive();
+    bus_pcicfg.set_exclusive();
+    bus_pit.set_exclusive();
+    bus_timeout.set_exclusive();
+  }
 };
@@ -17,7 +17,9 @@
  */
 #pragma once
 #include "service/cpu.h"
+#include "service/logging.h"
 #include "service/math.h"
+#include "service/string.h"
 
 
 typedef unsigned long long timevalue;
@@ -25,17 +27,18 @@ typedef unsigned long long timevalue;
 /**
  * A clock returns the time in different time domains.
  *
- * The reference clock is the CPUs TSC.
+ * The reference clock is the CPUs TSC, unless another source is given.
  */
 class Clock
 {
  protected:
   timevalue _source_freq;
+  timevalue (*_source)();
  public:
 #ifdef TESTING
   virtual
 #endif
-  timevalue time() { return Cpu::rdtsc(); }
+  timevalue time() { return _source ? _source() : Cpu::rdtsc(); }
 
   /**
    * Returns the current clock in freq-time.
@@ -68,7 +71,7 @@ class Clock
     return Math::muldiv128(theabstime - now, freq, _source_freq);
   }
 
-  Clock(timevalue source_freq) : _source_freq(source_freq) {}
+  Clock(timevalue source_freq, timevalue (*source)() = 0) : _source_freq(source_freq), _source(source) {}
 };
 
 
@@ -76,49 +79,126 @@ class Clock
 
 /**
  * Keeping track of the timeouts.
+ *
+ * The programmed timeouts are kept in a 4-ary min-heap, so that
+ * request and cancel are O(log n) and the next timeout is found in
+ * O(1). ENTRIES is only the initial capacity, the list grows on
+ * demand.
  */
 template <unsigned ENTRIES, typename DATA>
 class TimeoutList
 {
+  enum {
+    ARITY   = 4,
+    NOT_QUEUED = ~0u,
+  };
+
   class TimeoutEntry
   {
     friend class TimeoutList<ENTRIES, DATA>;
-    TimeoutEntry *_next;
-    TimeoutEntry *_prev;
     timevalue _timeout;
-    DATA * data;
+    DATA *    data;
+    unsigned  _pos;       // index in the heap or NOT_QUEUED
+    unsigned  _next_free; // next entry on the free list
     bool      _free;
   };
 
-  TimeoutEntry  _entries[ENTRIES];
+  TimeoutEntry *_entries;
+  unsigned     *_heap;
+  unsigned      _size;
+  unsigned      _count;
+  unsigned      _free_list;
+
+  /**
+   * To avoid bugs we disallow the copy constuctor.
+   */
+  TimeoutList(const TimeoutList &list) { Logging::panic("%s copy constructor called", __func__); }
+
+  void set_size(unsigned new_size)
+  {
+    TimeoutEntry *n = new TimeoutEntry[new_size];
+    unsigned     *h = new unsigned[new_size];
+    if (_entries) {
+      memcpy(n, _entries, _size * sizeof(*_entries));
+      memcpy(h, _heap, _count * sizeof(*_heap));
+      delete [] _entries;
+      delete [] _heap;
+    }
+    for (unsigned i = new_size; i-- > _size;) {
+      n[i]._pos       = NOT_QUEUED;
+      n[i].data       = 0;
+      n[i]._free      = true;
+      n[i]._next_free = _free_list;
+      _free_list      = i;
+    }
+    _entries = n;
+    _heap    = h;
+    _size    = new_size;
+  }
+
+  bool before(unsigned a, unsigned b) { return _entries[_heap[a]]._timeout < _entries[_heap[b]]._timeout; }
+
+  void place(unsigned pos, unsigned nr)
+  {
+    _heap[pos] = nr;
+    _entries[nr]._pos = pos;
+  }
+
+  void swap(unsigned a, unsigned b)
+  {
+    unsigned nr = _heap[a];
+    place(a, _heap[b]);
+    place(b, nr);
+  }
+
+  void sift_up(unsigned pos)
+  {
+    for (unsigned parent; pos && before(pos, parent = (pos - 1) / ARITY); pos = parent)
+      swap(pos, parent);
+  }
+
+  void sift_down(unsigned pos)
+  {
+    while (true) {
+      unsigned first = pos * ARITY + 1;
+      unsigned min = pos;
+      for (unsigned c = first; c < first + ARITY && c < _count; c++)
+        if (before(c, min)) min = c;
+      if (min == pos) return;
+      swap(pos, min);
+      pos = min;
+    }
+  }
+
+  bool queued(unsigned nr) { return nr && nr < _size && _entries[nr]._pos != NOT_QUEUED; }
+
 public:
   /**
    * Alloc a new timeout object.
    */
   unsigned alloc(DATA * _data = 0)
   {
-    unsigned i;
-    for (i=1; i < ENTRIES; i++) {
-      if (not _entries[i]._free) continue;
-      _entries[i].data  = _data;
-      _entries[i]._free = false;
-      return i;
-    }
-    Logging::panic("Can't alloc a timer!\n");
-    return 0;
+    if (!_free_list) set_size(_size * 2);
+    unsigned i = _free_list;
+    _free_list = _entries[i]._next_free;
+    _entries[i].data  = _data;
+    _entries[i]._free = false;
+    return i;
   }
 
   /**
    * Dealloc a timeout object.
    */
   unsigned dealloc(unsigned nr, bool withcancel = false) {
-    if (!nr || nr > ENTRIES - 1) return 0;
+    if (!nr || nr >= _size) return 0;
     if (_entries[nr]._free) return 0;
 
     // should only be done when no no concurrent access happens ...
     if (withcancel) cancel(nr);
     _entries[nr]._free = true;
     _entries[nr].data = 0;
+    _entries[nr]._next_free = _free_list;
+    _free_list = nr;
     return 1;
   }
 
@@ -127,14 +207,17 @@ public:
    */
   int cancel(unsigned nr)
   {
-    if (!nr || nr >= ENTRIES)  return -1;
-    TimeoutEntry *current = _entries+nr;
-    if (current->_next == current) return -2;
-    int res = _entries[0]._next != current;
-
-    current->_next->_prev =  current->_prev;
-    current->_prev->_next =  current->_next;
-    current->_next = current->_prev = current;
+    if (!nr || nr >= _size)  return -1;
+    if (!queued(nr)) return -2;
+    unsigned pos = _entries[nr]._pos;
+    int res = pos != 0;
+
+    _entries[nr]._pos = NOT_QUEUED;
+    if (pos != --_count) {
+      place(pos, _heap[_count]);
+      sift_up(pos);
+      sift_down(_entries[_heap[pos]]._pos);
+    }
     return res;
   }
 
@@ -144,20 +227,19 @@ public:
    */
   int request(unsigned nr, timevalue to)
   {
-    if (!nr || nr > ENTRIES)  return -1;
+    if (!nr || nr >= _size)  return -1;
     timevalue old = timeout();
-    TimeoutEntry *current = _entries + nr;
-    cancel(nr);
-
-    // keep a sorted list here
-    TimeoutEntry *t = _entries;
-    do { t = t->_next; }  while (t->_timeout < to);
-
-    current->_timeout = to;
-    current->_next = t;
-    current->_prev = t->_prev;
-    t->_prev->_next = current;
-    t->_prev = current;
+
+    if (queued(nr)) {
+      timevalue prev = _entries[nr]._timeout;
+      _entries[nr]._timeout = to;
+      if (to < prev) sift_up(_entries[nr]._pos);
+      else           sift_down(_entries[nr]._pos);
+    } else {
+      _entries[nr]._timeout = to;
+      place(_count, nr);
+      sift_up(_count++);
+    }
     return timeout() == old;
   }
 
@@ -165,8 +247,8 @@ public:
    * Get the head of the queue.
    */
   unsigned  trigger(timevalue now, DATA ** data = 0) {
-    if (now >= timeout()) {
-      unsigned i = _entries[0]._next - _entries;
+    if (_count && now >= timeout()) {
+      unsigned i = _heap[0];
       if (data)
         *data = _entries[i].data;
       return i;
@@ -174,18 +256,25 @@ public:
     return 0;
   }
 
-  timevalue timeout() { assert(_entries[0]._next); return _entries[0]._next->_timeout; }
+  timevalue timeout() { return _count ? _entries[_heap[0]]._timeout : ~0ULL; }
   void init()
   {
-    for (unsigned i = 0; i < ENTRIES; i++)
-      {
-        _entries[i]._prev = _entries + i;
-        _entries[i]._next = _entries + i;
-        _entries[i].data  = 0;
-        _entries[i]._free = true;
-      }
-    _entries[0]._timeout = ~0ULL;
+    if (_entries) {
+      delete [] _entries;
+      delete [] _heap;
+    }
+    _entries   = 0;
+    _heap      = 0;
+    _size      = 0;
+    _count     = 0;
+    _free_list = 0;
+
+    // entry 0 is never handed out
+    set_size(ENTRIES > 2 ? ENTRIES : 2);
+    _free_list = _entries[0]._next_free;
+    _entries[0]._free = false;
   }
 
-  TimeoutList() { init(); }
+  TimeoutList() : _entries(0), _heap(0) { init(); }
+  ~TimeoutList() { delete [] _entries; delete [] _heap; }
 };
@@ -47,6 +47,7 @@ struct CpuMessage {
           unsigned  io_order;
           unsigned  short port;
           void     *dst;
+          unsigned  io_count;
         };
       };
     };
@@ -69,8 +70,8 @@ struct CpuMessage {
 
   CpuMessage(Type _type, CpuState *_cpu, unsigned _mtr_in) : type(_type), cpu(_cpu), mtr_in(_mtr_in), mtr_out(0), consumed(0) { if (type == TYPE_CPUID) cpuid_index = cpu->eax; }
   CpuMessage(unsigned _nr, unsigned _reg, unsigned _mask, unsigned _value) : type(TYPE_CPUID_WRITE), nr(_nr), reg(_reg), mask(_mask), value(_value), consumed(0) {}
-  CpuMessage(bool is_in, CpuState *_cpu, unsigned _io_order, unsigned _port, void *_dst, unsigned _mtr_in)
-  : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
+  CpuMessage(bool is_in, CpuState *_cpu, unsigned _io_order, unsigned _port, void *_dst, unsigned _mtr_in, unsigned _io_count = 1)
+  : type(is_in ? TYPE_IOIN : TYPE_IOOUT), cpu(_cpu), io_order(_io_order), port(_port), dst(_dst), io_count(_io_count), mtr_in(_mtr_in), mtr_out(0), consumed(0) {}
 };
 
 
@@ -91,10 +92,39 @@ struct LapicEvent {
 };
 
 
+/**
+ * The lock a frontend uses to serialize the device models.
+ */
+class DeviceLock
+{
+public:
+  virtual void lock() = 0;
+  virtual void unlock() = 0;
+};
+
+
+/**
+ * Hold the device lock for a scope, if there is one.
+ */
+class DeviceGuard
+{
+  DeviceLock *_lock;
+public:
+  DeviceGuard(DeviceLock *lock) : _lock(lock) { if (_lock) _lock->lock(); }
+  ~DeviceGuard() { if (_lock) _lock->unlock(); }
+};
+
+
 class VCpu
 {
   VCpu *_last;
 public:
+  /**
+   * Set by frontends that execute guest code without holding the
+   * device lock.  The executors take it whenever they leave the
+   * vCPU-local state, i.e. send a message to the devices.
+   */
+  DeviceLock *device_lock;
   DBus<CpuMessage>       executor;
   DBus<CpuEvent>         bus_event;
   DBus<LapicEvent>       bus_lapic;
@@ -126,5 +156,5 @@ public:
   };
 
   unsigned long long inj_count;
-  VCpu (VCpu *last) : _last(last), inj_count(0) {}
+  VCpu (VCpu *last) : _last(last), device_lock(0), inj_count(0) {}
 };
@@ -25,6 +25,8 @@ class Cpu
 {
  public:
   static  void  pause() { asm volatile("pause"); }
+  /// Keeps the compiler from moving memory accesses across it
+  static  void  barrier() { asm volatile("" ::: "memory"); }
 
   template <typename T> static  void  atomic_and(T *ptr, T value) { __sync_and_and_fetch(ptr, value); }
   template <typename T> static  void  atomic_or(T *ptr, T value)  { __sync_or_and_fetch(ptr, value); }
@@ -32,7 +32,7 @@ class ParentIrqProvider
  * A port of an AhciController.
  *
  * State: unstable
- * Features: register set, FIS
+ * Features: register set, FIS, NCQ
  * Missing: plenty
  */
 class AhciPort : public FisReceiver
@@ -42,6 +42,7 @@ class AhciPort : public FisReceiver
   ParentIrqProvider *_parent;
   unsigned _ccs;
   unsigned _inprogress;
+  unsigned _queued;
   bool _need_initial_fis;
 
 
@@ -69,8 +70,11 @@ public:
     // XXX bug in 2.6.27?
     //if (!_need_initial_fis && ~PxCMD & 0x10) { Logging::printf("skip FIS %x\n", fis[0]); return; }
 
-    // update status and error fields
-    PxTFD = (PxTFD & 0xffff0000) | fis[0] >> 16;
+    // update status and error fields, a SDB FIS only touches some status bits
+    if ((fis[0] & 0xff) == 0xa1)
+      PxTFD = (PxTFD & 0xffff0088) | (fis[0] >> 16) & 0xff77;
+    else
+      PxTFD = (PxTFD & 0xffff0000) | fis[0] >> 16;
 
     switch (fis[0] & 0xff)
       {
@@ -92,9 +96,12 @@ public:
 	  unsigned mask = 1 << (fis[4] - 1);
 	  if (mask & ~_inprogress)
 	    Logging::panic("XXX broken %x,%x inprogress %x\n", fis[0], fis[4], _inprogress);
-	  _inprogress &= ~mask;
 	  PxCI &= ~mask;
-	  PxSACT &= ~mask;
+	  // a queued command was only accepted, it completes with a SDB FIS
+	  if (~_queued & mask) {
+	    _inprogress &= ~mask;
+	    PxSACT &= ~mask;
+	  }
 	}
 	else
 	  Logging::printf("not finished %x,%x inprogress %x\n", fis[0], fis[4], _inprogress);
@@ -109,6 +116,16 @@ public:
 
 	Logging::printf("PIO setup fis\n");
 	break;
+      case 0xa1: // set device bits fis
+	assert(fislen == 2);
+	copy_offset = 0x58;
+
+	// queued commands finished, possibly out of order
+	_inprogress &= ~fis[1];
+	_queued &= ~fis[1];
+	PxSACT &= ~fis[1];
+	if (fis[0] & 0x4000) PxIS |= 8;
+	break;
       default:
 	Logging::panic("Invalid D2H FIS!");
       }
@@ -142,8 +159,10 @@ public:
     PxSCTL = PxSCTL_reset;
     PxSERR = PxSERR_reset;
     PxCI   = PxCI_reset;
+    PxSACT = PxSACT_reset;
     _need_initial_fis = true;
     _inprogress = 0;
+    _queued = 0;
 
     if (_drive) {
 
@@ -181,6 +200,10 @@ public:
 	      copy_in(cl[2], ct, (clflags & 0x1f) * sizeof(unsigned));
 	      assert(~clflags & 0x20 && "ATAPI unimplemented");
 
+	      // READ/WRITE FPDMA QUEUED complete independently of PxCI
+	      unsigned char atacmd = ct[0] >> 16;
+	      if (atacmd == 0x60 || atacmd == 0x61) _queued |= 1 << slot;
+
 	      // send a dma_setup_fis
 	      // we reuse the reserved fields to send the PRD count and the slot
 	      unsigned dsf[7] = {0x41, cl[2] + 0x80, 0, clflags >> 16, 0, cl[1], slot+1};
@@ -197,7 +220,7 @@ public:
   }
 
 
-  AhciPort() : _drive(0), _parent(0), _ccs(), _inprogress(), _need_initial_fis() { AhciPort_reset(); };
+  AhciPort() : _drive(0), _parent(0), _ccs(), _inprogress(), _queued(), _need_initial_fis() { AhciPort_reset(); };
 
 };
 
@@ -251,7 +274,7 @@ REGSET(PCI,
        REG_RO(PCI_ID,        0x0, 0x275c8086)
        REG_RW(PCI_CMD_STS,   0x1, 0x100000, 0x0406,)
        REG_RO(PCI_RID_CC,    0x2, 0x01060102)
-       REG_RW(PCI_ABAR,      0x9, 0, 0xffffe000,)
+       REG_RW(PCI_ABAR,      0x9, 0, 0xffffe000, move_range();)
        REG_RO(PCI_SS,        0xb, 0x275c8086)
        REG_RO(PCI_CAP,       0xd, 0x80)
        REG_RW(PCI_INTR,      0xf, 0x0100, 0xff,)
@@ -297,6 +320,7 @@ class AhciController : public ParentIrqProvider,
   };
   DBus<MessageIrqLines> &_bus_irqlines;
   DBus<MessageMem> 	&_bus_mem;
+  unsigned _mem_range;
   unsigned char _irq;
   AhciPort _ports[MAX_PORTS];
   unsigned _bdf;
@@ -310,6 +334,10 @@ class AhciController : public ParentIrqProvider,
     return res;
   }
 
+  void move_range() {
+    if (~_mem_range) _bus_mem.move_range(_mem_range, PCI_ABAR >> 12, (~PCI_ABAR_mask + 1) >> 12);
+  }
+
 
  public:
 
@@ -334,9 +362,8 @@ class AhciController : public ParentIrqProvider,
   };
 
 
-  bool receive(MessageMem &msg)
+  bool mem_access(bool read, uintptr_t addr, unsigned *ptr)
   {
-    uintptr_t addr = msg.phys;
     if (!match_bar(addr) || !(PCI_CMD_STS & 0x2))
       return false;
 
@@ -345,14 +372,23 @@ class AhciController : public ParentIrqProvider,
     bool res;
     unsigned uvalue = 0;
     if (addr < 0x100)
-      res = msg.read ? AhciController_read(addr, uvalue) : AhciController_write(addr, *msg.ptr);
+      res = read ? AhciController_read(addr, uvalue) : AhciController_write(addr, *ptr);
     else if (addr < 0x100+MAX_PORTS*0x80)
-      res = msg.read ? _ports[(addr - 0x100) / 0x80].AhciPort_read(addr & 0x7f, uvalue) : _ports[(addr - 0x100) / 0x80].AhciPort_write(addr & 0x7f, *msg.ptr);
+      res = read ? _ports[(addr - 0x100) / 0x80].AhciPort_read(addr & 0x7f, uvalue) : _ports[(addr - 0x100) / 0x80].AhciPort_write(addr & 0x7f, *ptr);
     else
       return false;
 
-    if (res && msg.read)  *msg.ptr = uvalue;
-    else if (!res)  Logging::printf("%s(%zx) %s failed\n", __PRETTY_FUNCTION__, size_t(addr), msg.read ? "read" : "write");
+    if (res && read)  *ptr = uvalue;
+    else if (!res)  Logging::printf("%s(%zx) %s failed\n", __PRETTY_FUNCTION__, size_t(addr), read ? "read" : "write");
+    return true;
+  }
+
+
+  bool receive(MessageMem &msg)
+  {
+    if (!mem_access(msg.read, msg.phys, msg.ptr)) return false;
+    // continue a ranged access as long as it hits our registers
+    while (msg.count > 1 && mem_access(msg.read, msg.phys + 4, msg.ptr + 1)) msg.advance(1);
     return true;
   }
 
@@ -376,8 +412,18 @@ class AhciController : public ParentIrqProvider,
   }
 
   bool receive(MessagePciConfig &msg) { return PciHelper::receive(msg, this, _bdf); }
+
+  /**
+   * Claim the pages of our BAR on the memory bus.  They are moved
+   * whenever the BAR is reprogrammed.
+   */
+  void add_range() {
+    _mem_range = _bus_mem.add_range(this, 0, 0);
+    move_range();
+  }
+
   AhciController(Motherboard &mb, unsigned char irq, unsigned bdf)
-    : _bus_irqlines(mb.bus_irqlines), _bus_mem(mb.bus_mem), _irq(irq), _bdf(bdf)
+    : _bus_irqlines(mb.bus_irqlines), _bus_mem(mb.bus_mem), _mem_range(~0u), _irq(irq), _bdf(bdf)
   {
     for (unsigned i=0; i < MAX_PORTS; i++) _ports[i].set_parent(this, &mb.bus_memregion, &mb.bus_mem);
     PCI_reset();
@@ -394,6 +440,7 @@ PARAM_HANDLER(ahci,
 {
   AhciController *dev = new AhciController(mb, argv[1], PciHelper::find_free_bdf(mb.bus_pcicfg, argv[2]));
   mb.bus_mem.add(dev, AhciController::receive_static<MessageMem>);
+  dev->add_range();
 
   // register PCI device
   mb.bus_pcicfg.add(dev, AhciController::receive_static<MessagePciConfig>);
@@ -61,4 +61,6 @@ PARAM_HANDLER(dio,
   DirectIODevice *dev = new DirectIODevice(mb.bus_hwioin, mb.bus_hwioout, base, 1 << order);
   mb.bus_ioin.add(dev,  DirectIODevice::receive_static<MessageIOIn>);
   mb.bus_ioout.add(dev, DirectIODevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add_range(dev,  base, 1 << order);
+  mb.bus_ioout.add_range(dev, base, 1 << order);
 }
@@ -79,6 +79,8 @@ PARAM_HANDLER(mio,
   DirectMemDevice *dev = new DirectMemDevice(msg.ptr, dest, 1 << size);
   mb.bus_memregion.add(dev,  DirectMemDevice::receive_static<MessageMemRegion>);
   mb.bus_mem.add(dev,        DirectMemDevice::receive_static<MessageMem>);
+  mb.bus_memregion.add_range(dev, dest >> 12, ((dest & 0xfff) + (1 << size) + 0xfff) >> 12);
+  mb.bus_mem.add_range(dev,       dest >> 12, ((dest & 0xfff) + (1 << size) + 0xfff) >> 12);
 
 }
 
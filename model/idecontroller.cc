@@ -58,11 +58,28 @@ private:
   char              *_buffer;
   unsigned long      _baddr;
   unsigned           _bufferoffset;
+  Motherboard       *_mb;
+  // the ioport ranges of BAR0 on the in, out and string buses and of BAR1
+  unsigned           _bar0_range[4];
+  unsigned           _bar1_range[2];
 
 #define  REGBASE "../model/idecontroller.cc"
 #include "model/reg.h"
 
 
+  void move_ranges() {
+    if (!_mb) return;
+    unsigned bar0 = PCI_BAR0 & PCI_BAR0_mask, size0 = (~PCI_BAR0_mask & 0xffff) + 1;
+    unsigned bar1 = PCI_BAR1 & PCI_BAR1_mask, size1 = (~PCI_BAR1_mask & 0xffff) + 1;
+    _mb->bus_ioin.move_range(_bar0_range[0], bar0, size0);
+    _mb->bus_ioout.move_range(_bar0_range[1], bar0, size0);
+    _mb->bus_ioinstring.move_range(_bar0_range[2], bar0, size0);
+    _mb->bus_iooutstring.move_range(_bar0_range[3], bar0, size0);
+    _mb->bus_ioin.move_range(_bar1_range[0], bar1, size1);
+    _mb->bus_ioout.move_range(_bar1_range[1], bar1, size1);
+  }
+
+
   unsigned long long get_sector(bool lba48) {
     unsigned long long res = (_lbalow & 0xff) | (_lbamid & 0xff) << 8 | (_lbahigh & 0xff) << 16;
     if (lba48)
@@ -300,13 +317,69 @@ private:
   }
 
 
+  /**
+   * Transfer the data of the current sector at once.
+   */
+  unsigned data_string(unsigned port, unsigned order, unsigned count)
+  {
+    if ((port ^ PCI_BAR0) & PCI_BAR0_mask || port & ~PCI_BAR0_mask || _bufferoffset >= 512) return 0;
+    unsigned n = (512 - _bufferoffset) >> order;
+    return n < count ? n : count;
+  }
+
+
+  bool  receive(MessageIOInString &msg)
+  {
+    unsigned n = data_string(msg.port, msg.type, msg.count);
+    if (!n) return false;
+
+    unsigned len = n << msg.type;
+    memcpy(msg.ptr, _buffer + _bufferoffset, len);
+    msg.ptr = reinterpret_cast<char *>(msg.ptr) + len;
+    msg.count -= n;
+    _bufferoffset += len;
+    // reissue the command if work left
+    if (_bufferoffset >= 512)  issue_command(false);
+    return true;
+  }
+
+
+  bool  receive(MessageIOOutString &msg)
+  {
+    unsigned n = data_string(msg.port, msg.type, msg.count);
+    if (!n) return false;
+
+    unsigned len = n << msg.type;
+    memcpy(_buffer + _bufferoffset, msg.ptr, len);
+    msg.ptr = reinterpret_cast<char *>(msg.ptr) + len;
+    msg.count -= n;
+    _bufferoffset += len;
+    return true;
+  }
+
+
   bool receive(MessagePciConfig &msg) { return PciHelper::receive(msg, this, _bdf); }
 
 
+  /**
+   * Claim the ioports of our BARs on the buses we were added to.
+   */
+  void add_ranges(Motherboard &mb) {
+    _bar0_range[0] = mb.bus_ioin.add_range(this, 0, 0);
+    _bar0_range[1] = mb.bus_ioout.add_range(this, 0, 0);
+    _bar0_range[2] = mb.bus_ioinstring.add_range(this, 0, 0);
+    _bar0_range[3] = mb.bus_iooutstring.add_range(this, 0, 0);
+    _bar1_range[0] = mb.bus_ioin.add_range(this, 0, 0);
+    _bar1_range[1] = mb.bus_ioout.add_range(this, 0, 0);
+    _mb = &mb;
+    move_ranges();
+  }
+
+
   IdeController(DBus<MessageDisk> &bus_disk, DBus<MessageIrqLines> &bus_irqlines,
 		unsigned char irq, unsigned bdf, unsigned disknr, DiskParameter params, char *buffer, unsigned long baddr)
     : _bus_disk(bus_disk), _bus_irqlines(bus_irqlines),
-      _irq(irq), _bdf(bdf), _disknr(disknr), _params(params), _buffer(buffer), _baddr(baddr), _bufferoffset(0)
+      _irq(irq), _bdf(bdf), _disknr(disknr), _params(params), _buffer(buffer), _baddr(baddr), _bufferoffset(0), _mb(0)
   {
     PCI_reset();
     reset_device();
@@ -333,7 +406,10 @@ PARAM_HANDLER(ide,
   mb.bus_pcicfg.add(dev, IdeController::receive_static<MessagePciConfig>);
   mb.bus_ioin.  add(dev, IdeController::receive_static<MessageIOIn>);
   mb.bus_ioout. add(dev, IdeController::receive_static<MessageIOOut>);
+  mb.bus_ioinstring. add(dev, IdeController::receive_static<MessageIOInString>);
+  mb.bus_iooutstring.add(dev, IdeController::receive_static<MessageIOOutString>);
   mb.bus_diskcommit.add(dev, IdeController::receive_static<MessageDiskCommit>);
+  dev->add_ranges(mb);
   // set default state; this is normally done by the BIOS
   // set MMIO region and IRQ
    dev->PCI_write(IdeController::PCI_BAR0_offset, argv[0]);
@@ -348,8 +424,8 @@ REGSET(PCI,
        REG_RO(PCI_ID,        0x0, 0x275c8086)
        REG_RW(PCI_CMD_STS,   0x1, 0x100000, 0x0401,)
        REG_RO(PCI_RID_CC,    0x2, 0x01010102)
-       REG_RW(PCI_BAR0,      0x4, 1, 0x0000fff8,)
-       REG_RW(PCI_BAR1,      0x5, 1, 0x0000fffc,)
+       REG_RW(PCI_BAR0,      0x4, 1, 0x0000fff8, move_ranges();)
+       REG_RW(PCI_BAR1,      0x5, 1, 0x0000fffc, move_ranges();)
        REG_RO(PCI_SS,        0xb, 0x275c8086)
        REG_RO(PCI_CAP,       0xd, 0x00)
        REG_RW(PCI_INTR,      0xf, 0x0100, 0xff,));
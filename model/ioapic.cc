@@ -260,6 +260,8 @@ public:
   {
     reset();
     _mb.bus_mem.add(this,       receive_static<MessageMem>);
+    // the broadcast EOI is not sent to a single IOApic and thus does not need a range
+    _mb.bus_mem.add_range(this, _base >> 12, 1);
     _mb.bus_irqlines.add(this,  receive_static<MessageIrqLines>);
     _mb.bus_legacy.add(this,    receive_static<MessageLegacy>);
     _mb.bus_discovery.add(this, discover);
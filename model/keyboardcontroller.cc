@@ -354,6 +354,10 @@ PARAM_HANDLER(kbc,
   KeyboardController *dev = new KeyboardController(mb.bus_irqlines, mb.bus_ps2, mb.bus_legacy, argv[0], argv[1], argv[2], 2*kbc_count++);
   mb.bus_ioin.add(dev,  KeyboardController::receive_static<MessageIOIn>);
   mb.bus_ioout.add(dev, KeyboardController::receive_static<MessageIOOut>);
+  mb.bus_ioin.add_range(dev,  argv[0], 1);
+  mb.bus_ioin.add_range(dev,  argv[0] + 4, 1);
+  mb.bus_ioout.add_range(dev, argv[0], 1);
+  mb.bus_ioout.add_range(dev, argv[0] + 4, 1);
   mb.bus_ps2.add(dev,   KeyboardController::receive_static<MessagePS2>);
   mb.bus_legacy.add(dev,KeyboardController::receive_static<MessageLegacy>);
 }
@@ -107,7 +107,7 @@ private:
     init();
     _ID = _initial_apic_id << 24;
     _msr = 0;
-    set_base_msr(APIC_ADDR | 0x800);
+    set_base_msr(APIC_ADDR | 0x800 | (_vcpu->is_ap() ? 0 : 0x100));
   }
 
 
@@ -23,6 +23,7 @@ class MemoryController : public StaticReceiver<MemoryController>
   char *_physmem;
   uintptr_t _start;
   uintptr_t _end;
+  unsigned *_gen;
 
 
 public:
@@ -32,9 +33,16 @@ public:
   bool  receive(MessageMem &msg)
   {
     if ((msg.phys < _start) || (msg.phys >= (_end - 4)))  return false;
-    unsigned *ptr = reinterpret_cast<unsigned *>(_physmem + msg.phys);
+    char *ptr = _physmem + msg.phys;
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    // a ranged access is done at once
+    size_t len = 4 * MIN(msg.count, (_end - 4 - msg.phys + 3) / 4);
+    if (msg.read) memcpy(msg.ptr, ptr, len);
+    else {
+      memcpy(ptr, msg.ptr, len);
+      _gen[(msg.phys - _start) >> 12]++;
+    }
+    msg.advance(len / 4 - 1);
     return true;
   }
 
@@ -45,11 +53,12 @@ public:
     msg.start_page = _start >> 12;
     msg.count = (_end - _start) >> 12;
     msg.ptr = _physmem + _start;
+    msg.gen = _gen;
     return true;
   }
 
 
-  MemoryController(char *physmem, uintptr_t start, uintptr_t end) : _physmem(physmem), _start(start), _end(end) {}
+  MemoryController(char *physmem, uintptr_t start, uintptr_t end) : _physmem(physmem), _start(start), _end(end), _gen(new unsigned[(end - start + 0xfff) >> 12]()) {}
 };
 
 
@@ -69,4 +78,6 @@ PARAM_HANDLER(mem,
   // physmem access
   mb.bus_mem.add(dev,       MemoryController::receive_static<MessageMem>);
   mb.bus_memregion.add(dev, MemoryController::receive_static<MessageMemRegion>);
+  mb.bus_mem.add_range(dev,       start >> 12, (end - start + 0xfff) >> 12);
+  mb.bus_memregion.add_range(dev, start >> 12, (end - start + 0xfff) >> 12);
 }
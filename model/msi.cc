@@ -62,6 +62,8 @@ public:
 PARAM_HANDLER(msi,
 	      "msi - provide MSI support by forwarding access to 0xfee00000 to the LocalAPICs.")
 {
-  mb.bus_mem.add(new Msi(mb.bus_apic), Msi::receive_static<MessageMem>);
+  Msi *dev = new Msi(mb.bus_apic);
+  mb.bus_mem.add(dev, Msi::receive_static<MessageMem>);
+  mb.bus_mem.add_range(dev, MessageMem::MSI_ADDRESS >> 12, 1 << 8);
 }
 
@@ -49,5 +49,7 @@ PARAM_HANDLER(nullio,
   NullIODevice *dev = new NullIODevice(argv[0], argv[1] == ~0UL ? 1 : argv[1], argv[2]);
   mb.bus_ioin.add(dev,  NullIODevice::receive_static<MessageIOIn>);
   mb.bus_ioout.add(dev, NullIODevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.add_range(dev,  argv[0], argv[1] == ~0UL ? 1 : argv[1]);
+  mb.bus_ioout.add_range(dev, argv[0], argv[1] == ~0UL ? 1 : argv[1]);
 }
 
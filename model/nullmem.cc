@@ -44,6 +44,8 @@ PARAM_HANDLER(nullmem,
       "nullmem:<range> - ignore Memory access to the given physical address range.",
       "Example: 'nullmem:0xfee00000,0x1000'.")
 {
-  mb.bus_mem.add(new NullMemDevice(argv[0], argv[1]), NullMemDevice::receive_static<MessageMem>);
+  NullMemDevice *dev = new NullMemDevice(argv[0], argv[1]);
+  mb.bus_mem.add(dev, NullMemDevice::receive_static<MessageMem>);
+  mb.bus_mem.add_range(dev, argv[0] >> 12, ((argv[0] & 0xfff) + argv[1] + 0xfff) >> 12);
 }
 
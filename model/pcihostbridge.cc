@@ -117,22 +117,30 @@ public:
   /**
    * MMConfig access.
    */
-  bool  receive(MessageMem &msg) {
-    if (!in_range(msg.phys, _membase, _buscount << 20)) return false;
+  bool  mem_access(bool read, uintptr_t phys, unsigned *ptr) {
+    if (!in_range(phys, _membase, _buscount << 20)) return false;
 
-    unsigned bdf = (msg.phys - _membase) >> 12;
-    unsigned dword = (msg.phys & 0xfff) >> 2;
+    unsigned bdf = (phys - _membase) >> 12;
+    unsigned dword = (phys & 0xfff) >> 2;
 
     // write
-    if (!msg.read) {
-      MessagePciConfig msg1(bdf, dword, *msg.ptr);
+    if (!read) {
+      MessagePciConfig msg1(bdf, dword, *ptr);
       return _mb.bus_pcicfg.send(msg1);
     }
 
     // read
     MessagePciConfig msg2(bdf, dword);
     if (!_mb.bus_pcicfg.send(msg2)) return false;
-    *msg.ptr = msg2.value;
+    *ptr = msg2.value;
+    return true;
+  }
+
+
+  bool  receive(MessageMem &msg) {
+    if (!mem_access(msg.read, msg.phys, msg.ptr)) return false;
+    // continue a ranged access within the config space of the device
+    while (msg.count > 1 && mem_access(msg.read, msg.phys + 4, msg.ptr + 1)) msg.advance(1);
     return true;
   }
 
@@ -247,11 +255,14 @@ PARAM_HANDLER(pcihostbridge,
   if (~argv[2]) {
     mb.bus_ioin.add(dev,  PciHostBridge::receive_static<MessageIOIn>);
     mb.bus_ioout.add(dev, PciHostBridge::receive_static<MessageIOOut>);
+    mb.bus_ioin.add_range(dev,  argv[2], 8);
+    mb.bus_ioout.add_range(dev, argv[2], 8);
   }
 
   // MMCFG interface
   if (~argv[3]) {
     mb.bus_mem.add(dev,       PciHostBridge::receive_static<MessageMem>);
+    mb.bus_mem.add_range(dev, argv[3] >> 12, argv[1] << 8);
     mb.bus_discovery.add(dev, PciHostBridge::discover);
   }
 
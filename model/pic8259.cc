@@ -382,6 +382,12 @@ PARAM_HANDLER(pic,
 				 virq);
   mb.bus_ioin.    add(dev, PicDevice::receive_static<MessageIOIn>);
   mb.bus_ioout.   add(dev, PicDevice::receive_static<MessageIOOut>);
+  mb.bus_ioin.    add_range(dev, argv[0], 2);
+  mb.bus_ioout.   add_range(dev, argv[0], 2);
+  if (~argv[2]) {
+    mb.bus_ioin.  add_range(dev, argv[2], 1);
+    mb.bus_ioout. add_range(dev, argv[2], 1);
+  }
   mb.bus_irqlines.add(dev, PicDevice::receive_static<MessageIrqLines>);
   mb.bus_pic.     add(dev, PicDevice::receive_static<MessagePic>);
   if (!virq)
@@ -448,5 +448,8 @@ PARAM_HANDLER(pit,
 
   mb.bus_ioin.add(dev,  PitDevice::receive_static<MessageIOIn>);
   mb.bus_ioout.add(dev, PitDevice::receive_static<MessageIOOut>);
+  // three counters and the control word
+  mb.bus_ioin.add_range(dev,  argv[0], 4);
+  mb.bus_ioout.add_range(dev, argv[0], 4);
   mb.bus_pit.add(dev,   PitDevice::receive_static<MessagePit>);
 } 
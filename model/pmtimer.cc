@@ -55,6 +55,7 @@ public:
   PmTimer(Motherboard &mb, unsigned iobase) : _mb(mb), _iobase(iobase) {
 
     _mb.bus_ioin.add(this,      receive_static<MessageIOIn>);
+    _mb.bus_ioin.add_range(this, _iobase, 1);
     _mb.bus_discovery.add(this, discover);
   }
 };
@@ -436,6 +436,8 @@ PARAM_HANDLER(rtc,
   rtc->reset(msg1);
   mb.bus_ioin.     add(rtc, Rtc146818::receive_static<MessageIOIn>);
   mb.bus_ioout.    add(rtc, Rtc146818::receive_static<MessageIOOut>);
+  mb.bus_ioin.     add_range(rtc, argv[0], 8);
+  mb.bus_ioout.    add_range(rtc, argv[0], 8);
   mb.bus_timeout.  add(rtc, Rtc146818::receive_static<MessageTimeout>);
   mb.bus_irqnotify.add(rtc, Rtc146818::receive_static<MessageIrqNotify>);
 }
@@ -23,8 +23,8 @@
  * RTL8029 device model.
  *
  * State: unstable
- * Features: PCI, send, receive, broadcast, promiscuous mode
- * Missing: multicast, CRC calculation, rep optimized
+ * Features: PCI, send, receive, broadcast, promiscuous mode, string I/O for the remote DMA
+ * Missing: multicast, CRC calculation
  */
 #ifndef REGBASE
 class Rtl8029: public StaticReceiver<Rtl8029>
@@ -65,6 +65,9 @@ class Rtl8029: public StaticReceiver<Rtl8029>
     unsigned char imr;
   } __attribute__((packed)) _regs;
   unsigned char _mem[65536];
+  Motherboard *_mb;
+  // the ioport range of the BAR on the in, out and string buses
+  unsigned _io_range[4];
 #define  REGBASE "../model/rtl8029.cc"
 #include "model/reg.h"
 
@@ -266,6 +269,15 @@ class Rtl8029: public StaticReceiver<Rtl8029>
       }
   }
 
+  void move_ranges() {
+    if (!_mb) return;
+    unsigned start = PCI_BAR & PCI_BAR_mask, count = ~PCI_BAR_mask + 1;
+    _mb->bus_ioin.move_range(_io_range[0], start, count);
+    _mb->bus_ioout.move_range(_io_range[1], start, count);
+    _mb->bus_ioinstring.move_range(_io_range[2], start, count);
+    _mb->bus_iooutstring.move_range(_io_range[3], start, count);
+  }
+
   bool match_bar(unsigned long &address) {
     bool res = !((address ^ PCI_BAR) & PCI_BAR_mask);
     address &= ~PCI_BAR_mask;
@@ -304,11 +316,73 @@ public:
     return true;
   }
 
+  /**
+   * Copy the data of a remote DMA at once.  Elements that wrap
+   * around, hit the read-only page or are beyond the byte count are
+   * left to the byte-wise path.
+   */
+  unsigned remote_dma(unsigned long addr, unsigned order, unsigned count, unsigned char mode)
+  {
+    if (!match_bar(addr) || !(PCI_CMD_STS & 0x1) || addr < 0x10 || addr + (1u << order) > 0x18) return 0;
+    if ((_regs.cr & 0x38) != mode || mode == 0x10 && _regs.rsar < 0x100) return 0;
+
+    unsigned n = count;
+    if (n > unsigned(_regs.rbcr) >> order) n = _regs.rbcr >> order;
+    if (n > (sizeof(_mem) - _regs.rsar) >> order) n = (sizeof(_mem) - _regs.rsar) >> order;
+    return n;
+  }
+
+
+  bool receive(MessageIOInString &msg)
+  {
+    unsigned n = remote_dma(msg.port, msg.type, msg.count, 0x8);
+    if (!n) return false;
+
+    unsigned len = n << msg.type;
+    memcpy(msg.ptr, _mem + _regs.rsar, len);
+    msg.ptr = reinterpret_cast<char *>(msg.ptr) + len;
+    msg.count -= n;
+    _regs.rsar += len;
+    _regs.rbcr -= len;
+    if (!_regs.rbcr)  update_isr(0x40);
+    return true;
+  }
+
+
+  bool receive(MessageIOOutString &msg)
+  {
+    unsigned n = remote_dma(msg.port, msg.type, msg.count, 0x10);
+    if (!n) return false;
+
+    unsigned len = n << msg.type;
+    memcpy(_mem + _regs.rsar, msg.ptr, len);
+    msg.ptr = reinterpret_cast<char *>(msg.ptr) + len;
+    msg.count -= n;
+    _regs.rsar += len;
+    _regs.rbcr -= len;
+    if (!_regs.rbcr)  update_isr(0x40);
+    return true;
+  }
+
+
   bool receive(MessagePciConfig &msg)  {  return PciHelper::receive(msg, this, _bdf); }
 
 
+  /**
+   * Claim the ioports of our BAR on the buses we were added to.
+   */
+  void add_ranges(Motherboard &mb) {
+    _io_range[0] = mb.bus_ioin.add_range(this, 0, 0);
+    _io_range[1] = mb.bus_ioout.add_range(this, 0, 0);
+    _io_range[2] = mb.bus_ioinstring.add_range(this, 0, 0);
+    _io_range[3] = mb.bus_iooutstring.add_range(this, 0, 0);
+    _mb = &mb;
+    move_ranges();
+  }
+
+
   Rtl8029(DBus<MessageNetwork> &bus_network, DBus<MessageIrqLines> &bus_irqlines, unsigned char irq, unsigned long long mac, unsigned bdf) :
-    _bus_network(bus_network), _bus_irqlines(bus_irqlines),  _irq(irq), _mac(mac), _bdf(bdf)
+    _bus_network(bus_network), _bus_irqlines(bus_irqlines),  _irq(irq), _mac(mac), _bdf(bdf), _mb(0)
   {
     PCI_reset();
 
@@ -339,7 +413,10 @@ PARAM_HANDLER(rtl8029,
   mb.bus_pcicfg.add (dev, Rtl8029::receive_static<MessagePciConfig>);
   mb.bus_ioin.add   (dev, Rtl8029::receive_static<MessageIOIn>);
   mb.bus_ioout.add  (dev, Rtl8029::receive_static<MessageIOOut>);
+  mb.bus_ioinstring.add (dev, Rtl8029::receive_static<MessageIOInString>);
+  mb.bus_iooutstring.add(dev, Rtl8029::receive_static<MessageIOOutString>);
   mb.bus_network.add(dev, Rtl8029::receive_static<MessageNetwork>);
+  dev->add_ranges(mb);
 
 
   // set IO region and IRQ
@@ -356,7 +433,7 @@ REGSET(PCI,
        REG_RO(PCI_ID,       0x0, 0x802910ec)
        REG_RW(PCI_CMD_STS,  0x1, 0x02000000, 0x0003,)
        REG_RO(PCI_RID_CC,   0x2, 0x02000000)
-       REG_RW(PCI_BAR,      0x4, 1, 0xffffffe0,)
+       REG_RW(PCI_BAR,      0x4, 1, 0xffffffe0, move_ranges();)
        REG_RO(PCI_SS,       0xb, 0x802910ec)
        REG_RW(PCI_INTR,     0xf, 0x0100, 0x0f,));
 #endif
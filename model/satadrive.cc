@@ -27,7 +27,7 @@
  * speaks the SATA transport layer protocol with its FISes.
  *
  * State: unstable
- * Features: read,write,identify
+ * Features: read,write,identify,NCQ
  * Missing: better error handling, many commands
  */
 class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
@@ -41,7 +41,13 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   unsigned char _status;
   unsigned char _error;
   unsigned _dsf[7];
-  unsigned _splits[32];
+  unsigned _splits[33];
+  unsigned _queued;
+  // tags with requests from before a COMRESET and commands waiting for them
+  unsigned _stale;
+  unsigned _deferred;
+  unsigned _deferred_regs[32][4];
+  unsigned _deferred_dsf[32][7];
   DiskParameter _params;
   static unsigned const DMA_DESCRIPTORS = 64;
   DmaDescriptor _dma[DMA_DESCRIPTORS];
@@ -69,6 +75,35 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   }
 
 
+  /**
+   * A queued command was accepted.  We release BSY without an
+   * interrupt, so that the host can issue further commands.
+   */
+  void accept_queued_command()
+  {
+    unsigned d2h[5];
+    d2h[0] = _error << 24 | _status << 16 | _regs[0] & 0x0f00 | 0x34;
+    d2h[1] = _regs[1];
+    d2h[2] = _regs[2];
+    d2h[3] = _regs[3] & 0xffff;
+    d2h[4] = _dsf[6];
+    _peer->receive_fis(5, d2h);
+  }
+
+
+  /**
+   * A queued command is completed.  Commands can complete in any
+   * order, a set device bits FIS tells the host which one.
+   */
+  void send_sdb_fis(unsigned tag)
+  {
+    unsigned sdb[2];
+    sdb[0] = _error << 24 | (_status & 0x77) << 16 | 0x4000 | 0xa1;
+    sdb[1] = 1 << (tag - 1);
+    _peer->receive_fis(2, sdb);
+  }
+
+
   void send_pio_setup_fis(unsigned short length, bool irq = false)
   {
     unsigned psf[5];
@@ -112,7 +147,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     identify[61] = maxlba28 >> 16;
     identify[64] = 3;      // pio 3+4
     identify[75] = 0x1f;   // NCQ depth 32
-    identify[76] = 0x002;   // disabled NCQ + 1.5gbit
+    identify[76] = 0x102;   // NCQ + 1.5gbit
     identify[80] = 1 << 6; // major version number: ata-6
     identify[83] = 0x4000 | 1 << 10; // lba48
     identify[86] = 1 << 10; // lba48 enabled
@@ -177,7 +212,7 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     if (!_dsf[3]) return 0;
     uintptr_t prdbase = union64(_dsf[2], _dsf[1]);
 
-    assert(_dsf[6] < 32);
+    assert(_dsf[6] <= 32);
     assert(_splits[_dsf[6]] == 0);
 
     size_t prd = 0;
@@ -291,6 +326,11 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  _regs[3] = _regs[3] & 0xffff0000 | count;
 	  _regs[0] = _regs[0] & 0x00ffffff | (feature << 24);
 	  _regs[2] = _regs[2] & 0x00ffffff | (feature << 16) & 0xff000000;
+
+	  // the tag is the slot, which we get as _dsf[6]
+	  assert(_dsf[6] && _dsf[6] <= 32);
+	  _queued |= 1 << (_dsf[6] - 1);
+	  accept_queued_command();
 	  send_dma_setup_fis(read);
 	  readwrite_sectors(read, true);
 	}
@@ -340,7 +380,15 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
     _status = 0x40; // DRDY
     _error = 1;
     _ctrl = _regs[3] >> 24;
-    memset(_splits, 0, sizeof(_splits));
+
+    // requests still in flight are dropped when they commit
+    _stale = 0;
+    for (unsigned tag = 1; tag <= 32; tag++)
+      if (_splits[tag]) _stale |= 1 << (tag - 1);
+    _queued = 0;
+    _deferred = 0;
+    // a reset completes no command
+    _dsf[6] = 0;
     complete_command();
   };
 
@@ -363,7 +411,17 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
 	  memcpy(_regs, fis, sizeof(_regs));
 
 	  if (_regs[0] & 0x8000)
-	    execute_command();
+	    {
+	      // the tag is reused before its old requests drained
+	      if (_dsf[6] && _stale & (1 << (_dsf[6] - 1)))
+		{
+		  _deferred |= 1 << (_dsf[6] - 1);
+		  memcpy(_deferred_regs[_dsf[6] - 1], _regs, sizeof(_regs));
+		  memcpy(_deferred_dsf[_dsf[6] - 1], _dsf, sizeof(_dsf));
+		}
+	      else
+		execute_command();
+	    }
 	  else
 	    {
 
@@ -390,21 +448,48 @@ class SataDrive : public FisReceiver, public StaticReceiver<SataDrive>
   bool receive(MessageDiskCommit &msg)
   {
     if (msg.disknr != _hostdisk || msg.usertag > 32) return false;
+    assert(_splits[msg.usertag]);
+    unsigned mask = msg.usertag ? 1 << (msg.usertag - 1) : 0;
+
+    // a request from before a COMRESET, run a command that waited for it
+    if (_stale & mask)
+      {
+	if (!--_splits[msg.usertag])
+	  {
+	    _stale &= ~mask;
+	    if (_deferred & mask)
+	      {
+		_deferred &= ~mask;
+		memcpy(_regs, _deferred_regs[msg.usertag - 1], sizeof(_regs));
+		memcpy(_dsf, _deferred_dsf[msg.usertag - 1], sizeof(_dsf));
+		execute_command();
+	      }
+	  }
+	return true;
+      }
+
     // we are done
     _status = _status & ~0x8;
-    assert(_splits[msg.usertag]);
     assert(!msg.status);
     if (!--_splits[msg.usertag])
       {
-	_dsf[6] = msg.usertag;
-	complete_command();
+	if (_queued & mask)
+	  {
+	    _queued &= ~mask;
+	    send_sdb_fis(msg.usertag);
+	  }
+	else
+	  {
+	    _dsf[6] = msg.usertag;
+	    complete_command();
+	  }
       }
     return true;
   }
 
 
   SataDrive(DBus<MessageDisk> &bus_disk, DBus<MessageMemRegion> *bus_memregion, DBus<MessageMem> *bus_mem, unsigned hostdisk, DiskParameter params)
-    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _regs(), _ctrl(0), _status(), _error(), _dsf(), _splits(), _params(params), _dma()
+    : _bus_memregion(bus_memregion), _bus_mem(bus_mem), _bus_disk(bus_disk), _hostdisk(hostdisk), _multiple(0), _regs(), _ctrl(0), _status(), _error(), _dsf(), _splits(), _queued(), _stale(), _deferred(), _deferred_regs(), _deferred_dsf(), _params(params), _dma()
   {
     Logging::printf("SATA disk %x flags %x sectors %zx\n", hostdisk, _params.flags, size_t(_params.sectors));
   }
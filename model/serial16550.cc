@@ -87,6 +87,24 @@ private:
   }
 
 
+  /**
+   * Send a character to the host or back to us in loopback mode.
+   */
+  void transmit(unsigned value)
+  {
+    MessageSerial msg2(_hostserial, value & _sendmask);
+    if (_regs[MCR] & 0x10)
+      // loopback
+      receive(msg2);
+    else
+      {
+	// write directly, no write fifo here
+	msg2.serial++;
+	_mb.bus_serial.send(msg2);
+      }
+  }
+
+
 public:
   bool  receive(MessageSerial &msg)
   {
@@ -173,18 +191,7 @@ public:
     switch (offset)
       {
       case THR:
-	{
-	  MessageSerial msg2(_hostserial, msg.value & _sendmask);
-	  if (_regs[MCR] & 0x10)
-	    // loopback
-	    receive(msg2);
-	  else
-	    {
-	      // write directly, no write fifo here
-	      msg2.serial++;
-	      _mb.bus_serial.send(msg2);
-	    }
-	}
+	transmit(msg.value);
 	break;
       case IER:
 	_regs[offset] = msg.value & 0xf;
@@ -234,6 +241,38 @@ public:
   }
 
 
+  /**
+   * Drain the receive fifo at once.
+   */
+  bool  receive(MessageIOInString &msg)
+  {
+    if (msg.port != _base || msg.type != MessageIOIn::TYPE_INB || _regs[LCR] & 0x80 || ~_regs[FCR] & 1 || !_rfcount)
+      return false;
+
+    unsigned char *ptr = reinterpret_cast<unsigned char *>(msg.ptr);
+    for (; msg.count && _rfcount; msg.count--, _rfcount--)
+      *ptr++ = _rfifo[(_rfpos - _rfcount) % FIFOSIZE];
+    msg.ptr = ptr;
+    if (!_rfcount) _regs[LSR] &= ~1;
+    update_irq();
+    return true;
+  }
+
+
+  bool  receive(MessageIOOutString &msg)
+  {
+    if (msg.port != _base || msg.type != MessageIOOut::TYPE_OUTB || _regs[LCR] & 0x80)
+      return false;
+
+    unsigned char *ptr = reinterpret_cast<unsigned char *>(msg.ptr);
+    for (; msg.count; msg.count--)
+      transmit(*ptr++);
+    msg.ptr = ptr;
+    update_irq();
+    return true;
+  }
+
+
   void discovery() {
 
     unsigned installed_hw = ~0u;
@@ -256,6 +295,12 @@ public:
       _regs[MSR] = 0xb0;
       _mb.bus_ioin.     add(this, receive_static<MessageIOIn>);
       _mb.bus_ioout.    add(this, receive_static<MessageIOOut>);
+      _mb.bus_ioinstring. add(this, receive_static<MessageIOInString>);
+      _mb.bus_iooutstring.add(this, receive_static<MessageIOOutString>);
+      _mb.bus_ioin.     add_range(this, _base, 8);
+      _mb.bus_ioout.    add_range(this, _base, 8);
+      _mb.bus_ioinstring. add_range(this, _base, 1);
+      _mb.bus_iooutstring.add_range(this, _base, 1);
       _mb.bus_serial.   add(this, receive_static<MessageSerial>);
       _mb.bus_discovery.add(this, discover);
     }
@@ -104,4 +104,8 @@ PARAM_HANDLER(scp,
   SystemControlPort *scp = new SystemControlPort(mb.bus_legacy, mb.bus_pit, argv[0], argv[1]);
   mb.bus_ioin.add(scp,  SystemControlPort::receive_static<MessageIOIn>);
   mb.bus_ioout.add(scp, SystemControlPort::receive_static<MessageIOOut>);
+  mb.bus_ioin.add_range(scp,  argv[0], 1);
+  mb.bus_ioin.add_range(scp,  argv[1], 1);
+  mb.bus_ioout.add_range(scp, argv[0], 1);
+  mb.bus_ioout.add_range(scp, argv[1], 1);
 }
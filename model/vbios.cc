@@ -27,18 +27,17 @@ public:
 private:
   VCpu *_vcpu;
   unsigned char _resetvector[16];
-  enum {  BIOS_BASE = 0xf0000 };
+  enum {  BIOS_BASE = BiosCommon::BIOS_BASE };
 
 public:
   bool receive(CpuMessage &msg) {
     if (msg.type != CpuMessage::TYPE_SINGLE_STEP) return false;
 
     CpuState *cpu = msg.cpu;
-    if (cpu->pm() && !cpu->v86()
-	|| !in_range(cpu->cs.base + cpu->eip, BIOS_BASE, BiosCommon::MAX_VECTOR)
-	|| cpu->inj_info & 0x80000000) return false;
+    if (!BiosCommon::hooked_vector(cpu) || cpu->inj_info & 0x80000000) return false;
 
     COUNTER_INC("VB");
+    DeviceGuard guard(_vcpu->device_lock);
     unsigned irq =  (cpu->cs.base + cpu->eip) - BIOS_BASE;
 
     /**
@@ -87,7 +87,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
 
   void handle_rdtsc(CpuMessage &msg) {
     assert((msg.mtr_in & MTD_TSC) and (msg.mtr_in & MTD_GPR_ACDB));
-    msg.cpu->edx_eax(get_tsc_off(msg) + Cpu::rdtsc());
+    msg.cpu->edx_eax(get_tsc_off(msg) + _mb.clock()->time());
     msg.mtr_out |= MTD_GPR_ACDB;
   }
 
@@ -128,7 +128,7 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
         {
           long long offset    = get_tsc_off(msg);
 
-          msg.current_tsc_off = - Cpu::rdtsc()        + cpu->edx_eax();
+          msg.current_tsc_off = - _mb.clock()->time() + cpu->edx_eax();
           cpu->tsc_off        =   msg.current_tsc_off - offset;
         }
 	msg.mtr_out |= MTD_TSC;
@@ -217,6 +217,9 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
       Cpu::atomic_and<volatile unsigned>(&_event, ~VCpu::EVENT_RESET);
       handle_cpu_init(msg, true);
 
+      // APs wait for an INIT and a SIPI from the BSP
+      if (is_ap()) cpu->actv_state = 3;
+
       // fall through as we could have got an INIT or SIPI already
     }
 
@@ -284,28 +287,53 @@ class VirtualCpu : public VCpu, public StaticReceiver<VirtualCpu>
   }
 
   void handle_ioin(CpuMessage &msg) {
-    MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
-    bool res = _mb.bus_ioin.send(msg2);
+    char *dst = reinterpret_cast<char *>(msg.dst);
+    unsigned count = msg.io_count;
+
+    // give devices the chance to transfer a string at once
+    if (count > 1) {
+      MessageIOInString msg2(MessageIOIn::Type(msg.io_order), msg.port, count, dst);
+      if (_mb.bus_ioinstring.send(msg2)) msg.consumed = 1;
+      dst   = reinterpret_cast<char *>(msg2.ptr);
+      count = msg2.count;
+    }
 
-    Cpu::move(msg.dst, &msg2.value, msg.io_order);
-    msg.mtr_out |= MTD_GPR_ACDB;
+    for (; count; count--, dst += 1 << msg.io_order) {
+      MessageIOIn msg2(MessageIOIn::Type(msg.io_order), msg.port);
+      bool res = _mb.bus_ioin.send(msg2);
 
-    if (!res && ~debugioin[msg.port >> 3] & (1 << (msg.port & 7))) {
-      debugioin[msg.port >> 3] |= 1 << (msg.port & 7);
-      //dprintf("could not read from ioport %x eip %x cs %x-%x\n", msg.port, msg.cpu->eip, msg.cpu->cs.base, msg.cpu->cs.ar);
-    } else msg.consumed = 1;
+      Cpu::move(dst, &msg2.value, msg.io_order);
+      msg.mtr_out |= MTD_GPR_ACDB;
+
+      if (!res && ~debugioin[msg.port >> 3] & (1 << (msg.port & 7))) {
+        debugioin[msg.port >> 3] |= 1 << (msg.port & 7);
+        //dprintf("could not read from ioport %x eip %x cs %x-%x\n", msg.port, msg.cpu->eip, msg.cpu->cs.base, msg.cpu->cs.ar);
+      } else msg.consumed = 1;
+    }
   }
 
 
   void handle_ioout(CpuMessage &msg) {
-    MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
-    Cpu::move(&msg2.value, msg.dst, msg.io_order);
-
-    bool res = _mb.bus_ioout.send(msg2);
-    if (!res && ~debugioout[msg.port >> 3] & (1 << (msg.port & 7))) {
-      debugioout[msg.port >> 3] |= 1 << (msg.port & 7);
-      //dprintf("could not write %x to ioport %x eip %x\n", msg.cpu->eax, msg.port, msg.cpu->eip);
-    } else msg.consumed = 1;
+    char *src = reinterpret_cast<char *>(msg.dst);
+    unsigned count = msg.io_count;
+
+    if (count > 1) {
+      MessageIOOutString msg2(MessageIOOut::Type(msg.io_order), msg.port, count, src);
+      if (_mb.bus_iooutstring.send(msg2)) msg.consumed = 1;
+      src   = reinterpret_cast<char *>(msg2.ptr);
+      count = msg2.count;
+    }
+
+    for (; count; count--, src += 1 << msg.io_order) {
+      MessageIOOut msg2(MessageIOOut::Type(msg.io_order), msg.port, 0);
+      Cpu::move(&msg2.value, src, msg.io_order);
+
+      bool res = _mb.bus_ioout.send(msg2);
+      if (!res && ~debugioout[msg.port >> 3] & (1 << (msg.port & 7))) {
+        debugioout[msg.port >> 3] |= 1 << (msg.port & 7);
+        //dprintf("could not write %x to ioport %x eip %x\n", msg.cpu->eax, msg.port, msg.cpu->eip);
+      } else msg.consumed = 1;
+    }
   }
 
   /**
@@ -465,7 +493,7 @@ public:
     MessageHostOp msg(this);
     if (!mb.bus_hostop.send(msg)) Logging::panic("could not create VCpu backend.");
     _hostop_id = msg.value;
-    _reset_tsc_off = -Cpu::rdtsc();
+    _reset_tsc_off = -mb.clock()->time();
 
     // add to the busses
     executor. add(this, VirtualCpu::receive_static<CpuMessage>);
@@ -470,14 +470,22 @@ public:
 
   bool  receive(MessageMem &msg)
   {
-    unsigned *ptr;
-    if (in_range(msg.phys, _framebuffer_phys, _framebuffer_size))
-      ptr = reinterpret_cast<unsigned *>(_framebuffer_ptr + msg.phys - _framebuffer_phys);
-    else if (in_range(msg.phys, LOW_BASE, LOW_SIZE))
-      ptr = reinterpret_cast<unsigned *>(_framebuffer_ptr + msg.phys - LOW_BASE);
+    char *ptr;
+    size_t left;
+    if (in_range(msg.phys, _framebuffer_phys, _framebuffer_size)) {
+      ptr = _framebuffer_ptr + msg.phys - _framebuffer_phys;
+      left = _framebuffer_phys + _framebuffer_size - msg.phys;
+    }
+    else if (in_range(msg.phys, LOW_BASE, LOW_SIZE)) {
+      ptr = _framebuffer_ptr + msg.phys - LOW_BASE;
+      left = LOW_BASE + LOW_SIZE - msg.phys;
+    }
     else return false;
 
-    if (msg.read) *msg.ptr = *ptr; else *ptr = *msg.ptr;
+    // a ranged access is done at once
+    size_t len = 4 * MIN(msg.count, (left + 3) / 4);
+    if (msg.read) memcpy(msg.ptr, ptr, len); else memcpy(ptr, msg.ptr, len);
+    msg.advance(len / 4 - 1);
     return true;
   }
 
@@ -523,6 +531,17 @@ public:
   }
 
 
+  /**
+   * Claim the framebuffer pages on a bus we were added to.
+   */
+  template <class M>
+  void add_ranges(DBus<M> &bus)
+  {
+    bus.add_range(this, _framebuffer_phys >> 12, _framebuffer_size >> 12);
+    bus.add_range(this, LOW_BASE >> 12, LOW_SIZE >> 12);
+  }
+
+
   Vga(Motherboard &mb, unsigned short iobase, char *framebuffer_ptr, uintptr_t framebuffer_phys, size_t framebuffer_size)
     : BiosCommon(mb), _iobase(iobase), _framebuffer_ptr(framebuffer_ptr), _framebuffer_phys(framebuffer_phys), _framebuffer_size(framebuffer_size), _crt_index(0), _ebda_segment(), _vbe_mode()
   {
@@ -572,9 +591,13 @@ PARAM_HANDLER(vga,
   Vga *dev = new Vga(mb, argv[0], msg2.ptr + msg.phys, msg.phys, fbsize);
   mb.bus_ioin     .add(dev, Vga::receive_static<MessageIOIn>);
   mb.bus_ioout    .add(dev, Vga::receive_static<MessageIOOut>);
+  mb.bus_ioin     .add_range(dev, argv[0], 32);
+  mb.bus_ioout    .add_range(dev, argv[0], 32);
   mb.bus_bios     .add(dev, Vga::receive_static<MessageBios>);
   mb.bus_mem      .add(dev, Vga::receive_static<MessageMem>);
   mb.bus_memregion.add(dev, Vga::receive_static<MessageMemRegion>);
+  dev->add_ranges(mb.bus_mem);
+  dev->add_ranges(mb.bus_memregion);
   mb.bus_discovery.add(dev, Vga::receive_static<MessageDiscovery>);
 }
 
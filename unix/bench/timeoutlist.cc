@@ -0,0 +1,241 @@
+/** @file
+ * Microbenchmark of the TimeoutList against the former sorted list.
+ *
+ * This file is part of Vancouver.
+ *
+ * Vancouver is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Vancouver is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+// Build with 'scons bench/timeoutlist'. The benchmark first checks
+// that both lists agree on random operations, then measures random
+// rearm and trigger cycles, as the timer models of a guest do them.
+
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+
+#include <nul/timer.h>
+
+void Logging::panic(const char *format, ...)
+{
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(stderr, format, ap);
+  va_end(ap);
+  abort();
+}
+
+void Logging::printf(const char *, ...) {}
+
+
+/**
+ * The former TimeoutList: a sorted list with a fixed number of entries.
+ */
+template <unsigned ENTRIES, typename DATA>
+class SortedTimeoutList
+{
+  class TimeoutEntry
+  {
+    friend class SortedTimeoutList<ENTRIES, DATA>;
+    TimeoutEntry *_next;
+    TimeoutEntry *_prev;
+    timevalue _timeout;
+    DATA * data;
+    bool      _free;
+  };
+
+  TimeoutEntry  _entries[ENTRIES];
+public:
+  /**
+   * Alloc a new timeout object.
+   */
+  unsigned alloc(DATA * _data = 0)
+  {
+    unsigned i;
+    for (i=1; i < ENTRIES; i++) {
+      if (not _entries[i]._free) continue;
+      _entries[i].data  = _data;
+      _entries[i]._free = false;
+      return i;
+    }
+    Logging::panic("Can't alloc a timer!\n");
+    return 0;
+  }
+
+  /**
+   * Dealloc a timeout object.
+   */
+  unsigned dealloc(unsigned nr, bool withcancel = false) {
+    if (!nr || nr > ENTRIES - 1) return 0;
+    if (_entries[nr]._free) return 0;
+
+    // should only be done when no no concurrent access happens ...
+    if (withcancel) cancel(nr);
+    _entries[nr]._free = true;
+    _entries[nr].data = 0;
+    return 1;
+  }
+
+  /**
+   * Cancel a programmed timeout.
+   */
+  int cancel(unsigned nr)
+  {
+    if (!nr || nr >= ENTRIES)  return -1;
+    TimeoutEntry *current = _entries+nr;
+    if (current->_next == current) return -2;
+    int res = _entries[0]._next != current;
+
+    current->_next->_prev =  current->_prev;
+    current->_prev->_next =  current->_next;
+    current->_next = current->_prev = current;
+    return res;
+  }
+
+
+  /**
+   * Request a new timeout.
+   */
+  int request(unsigned nr, timevalue to)
+  {
+    if (!nr || nr > ENTRIES)  return -1;
+    timevalue old = timeout();
+    TimeoutEntry *current = _entries + nr;
+    cancel(nr);
+
+    // keep a sorted list here
+    TimeoutEntry *t = _entries;
+    do { t = t->_next; }  while (t->_timeout < to);
+
+    current->_timeout = to;
+    current->_next = t;
+    current->_prev = t->_prev;
+    t->_prev->_next = current;
+    t->_prev = current;
+    return timeout() == old;
+  }
+
+  /**
+   * Get the head of the queue.
+   */
+  unsigned  trigger(timevalue now, DATA ** data = 0) {
+    if (now >= timeout()) {
+      unsigned i = _entries[0]._next - _entries;
+      if (data)
+        *data = _entries[i].data;
+      return i;
+    }
+    return 0;
+  }
+
+  timevalue timeout() { assert(_entries[0]._next); return _entries[0]._next->_timeout; }
+  void init()
+  {
+    for (unsigned i = 0; i < ENTRIES; i++)
+      {
+        _entries[i]._prev = _entries + i;
+        _entries[i]._next = _entries + i;
+        _entries[i].data  = 0;
+        _entries[i]._free = true;
+      }
+    _entries[0]._timeout = ~0ULL;
+  }
+
+  SortedTimeoutList() { init(); }
+};
+
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned seed;
+static unsigned rnd()
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+// Both lists have to return the same head after every operation.
+static bool equivalent(unsigned ops)
+{
+  static TimeoutList<32, void>       heap;
+  static SortedTimeoutList<32, void> list;
+  for (unsigned i = 1; i < 31; i++) { heap.alloc(); list.alloc(); }
+
+  seed = 7;
+  for (unsigned i = 0; i < ops; i++) {
+    unsigned nr = 1 + rnd() % 30;
+    switch (rnd() % 3) {
+    case 0:
+      {
+        timevalue to = rnd();
+        heap.request(nr, to);
+        list.request(nr, to);
+      }
+      break;
+    case 1:
+      if (heap.cancel(nr) != list.cancel(nr)) return false;
+      break;
+    }
+    if (heap.timeout() != list.timeout()) return false;
+  }
+  return true;
+}
+
+// Returns the average time of one rearm in nanoseconds, including the
+// expiries it causes.
+template <class LIST>
+static double bench(unsigned timers, unsigned ops)
+{
+  LIST *l = new LIST;
+  unsigned *nr = new unsigned[timers];
+  for (unsigned i = 0; i < timers; i++) nr[i] = l->alloc();
+
+  seed = 1;
+  timevalue now = 0;
+  unsigned long long start = now_ns();
+  for (unsigned i = 0; i < ops; i++) {
+    now += 10;
+    l->request(nr[rnd() % timers], now + rnd() % (timers * 1000));
+    for (unsigned t; (t = l->trigger(now)); ) l->cancel(t);
+  }
+  double res = double(now_ns() - start) / ops;
+
+  delete [] nr;
+  delete l;
+  return res;
+}
+
+int main()
+{
+  enum { OPS = 2000000 };
+  if (!equivalent(1000000)) {
+    fprintf(stderr, "TimeoutList and the sorted list disagree\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("timers   list     heap\n");
+  // the sorted list holds at most 31 timers
+  static const unsigned small[] = { 4, 16, 30 };
+  for (unsigned timers : small)
+    printf("%-8u %-8.0f %.0f\n", timers,
+           bench<SortedTimeoutList<32, void> >(timers, OPS),
+           bench<TimeoutList<32, void> >(timers, OPS));
+  static const unsigned large[] = { 256, 4096 };
+  for (unsigned timers : large)
+    printf("%-8u -        %.0f\n", timers, bench<TimeoutList<32, void> >(timers, OPS));
+  return EXIT_SUCCESS;
+}
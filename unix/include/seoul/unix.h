@@ -20,8 +20,17 @@
 
 #include <pthread.h>
 
-// Serialize access for devices. Currently also used to serialize
-// everything else.
-extern pthread_mutex_t irq_mtx;
+// Serialize access for devices. vCPUs only take it when they leave
+// their local state, e.g. on IO or MMIO.
+extern pthread_mutex_t device_mtx;
+
+// Call fn from the I/O thread whenever fd becomes readable. The
+// handler runs without the device lock. If it returns false, fd is
+// closed and no longer watched.
+typedef bool (*IoHandler)(int fd, void *arg);
+void io_add(int fd, IoHandler fn, void *arg);
+
+// Print statistics of the vCPU threads.
+void dump_vcpu_stats();
 
 // EOF
@@ -36,10 +36,14 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <errno.h>
 
 #include <pthread.h>
@@ -58,6 +62,10 @@ const char version_str[] =
 static char  *ram;
 static size_t ram_size = 128 << 20; // 128 MB
 static int    tap_fd;               // TAP device. If 0, network packets go to /dev/null.
+static bool   use_jit;              // Translate simple guest code instead of emulating it.
+static unsigned vcpu_count = 1;
+static unsigned timer_slack_ns = 50000; // Timeouts this close together fire at once.
+static bool   time_warp;            // Skip idle time to the next timeout.
 
 static const char *pc_ps2[] = {
   // Unix backend
@@ -86,7 +94,11 @@ static const char *pc_ps2[] = {
   "rtl8029:,9,0x300",
   "ahci:0xe0800000,14",
   "pmtimer:0x8000",
-  // 1 vCPU
+  NULL,
+  };
+
+// Instantiated for every vCPU. The first one is the BSP.
+static const char *pc_vcpu[] = {
   "vcpu", "halifax", "vbios", "lapic",
   NULL,
   };
@@ -94,13 +106,51 @@ static const char *pc_ps2[] = {
 // Globals
 
 static TimeoutList<32, void> timeouts;
-static timevalue             last_to = ~0ULL;
-static timer_t               timer_id;
+static unsigned long long    armed_ns = ~0ULL; // Absolute CLOCK_MONOTONIC deadline of timer_fd
+static int                   timer_fd;
 
 
-static Clock                 mb_clock(1000000);   // XXX Use correct frequency
+static Clock                 mb_clock(1000000);   // Replaced by host_clock() at startup.
 static Motherboard           mb(&mb_clock, NULL);
 
+// I/O reactor. A single thread waits for all host file descriptors.
+
+struct IoSource {
+  int       fd;
+  IoHandler fn;
+  void     *arg;
+};
+
+static int io_epoll_fd;
+
+void io_add(int fd, IoHandler fn, void *arg)
+{
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = new IoSource { fd, fn, arg };
+  if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void *io_thread_fn(void *)
+{
+  struct epoll_event ev[16];
+  while (true) {
+    int n = epoll_wait(io_epoll_fd, ev, sizeof(ev) / sizeof(*ev), -1);
+    for (int i = 0; i < n; i++) {
+      IoSource *src = reinterpret_cast<IoSource *>(ev[i].data.ptr);
+      if (!src->fn(src->fd, src->arg)) {
+        epoll_ctl(io_epoll_fd, EPOLL_CTL_DEL, src->fd, nullptr);
+        close(src->fd);
+        delete src;
+      }
+    }
+  }
+  return nullptr;
+}
+
 // Multiboot module data
 
 struct Module {
@@ -163,8 +213,13 @@ struct Disk {
 
 static std::vector<Disk> disks;
 
-// Used to serialize all operations (for now).
-pthread_mutex_t irq_mtx;
+// Serializes the device models.  vCPUs execute guest code without it.
+pthread_mutex_t device_mtx;
+
+static struct : public DeviceLock {
+  void lock()   { pthread_mutex_lock(&device_mtx); }
+  void unlock() { pthread_mutex_unlock(&device_mtx); }
+} device_lock;
 
 static void skip_instruction(CpuMessage &msg)
 {
@@ -190,10 +245,15 @@ static void handle_vcpu(bool skip, CpuMessage::Type type, VCpu *vcpu, CpuState *
   if (skip) skip_instruction(msg);
 
   /**
-   * Send the message to the VCpu.
+   * Send the message to the VCpu.  Guest code is executed without the
+   * device lock, as the executor takes it on its own.
    */
-  if (!vcpu->executor.send(msg, true))
-    Logging::panic("nobody to execute %s at %x:%x\n", __func__, msg.cpu->cs.sel, msg.cpu->eip);
+  {
+    DeviceGuard guard(type == CpuMessage::TYPE_SINGLE_STEP ? nullptr : &device_lock);
+    if (!vcpu->executor.send(msg, true))
+      Logging::panic("nobody to execute %s at %x:%x\n", __func__, msg.cpu->cs.sel, msg.cpu->eip);
+  }
+  DeviceGuard guard(&device_lock);
 
   /**
    * Check whether we should inject something...
@@ -225,15 +285,11 @@ static void *vcpu_thread_fn(void *arg)
   CpuState cpu_state;
   memset(&cpu_state, 0, sizeof(cpu_state));
 
-  pthread_mutex_lock(&irq_mtx);
   handle_vcpu(false, CpuMessage::TYPE_HLT, vcpu, &cpu_state);
-  pthread_mutex_unlock(&irq_mtx);
 
   while (true) {
-    pthread_mutex_lock(&irq_mtx);
     handle_vcpu(false, CpuMessage::TYPE_SINGLE_STEP, vcpu, &cpu_state);
     // Logging::printf("eip %x\n", cpu_state.eip);
-    pthread_mutex_unlock(&irq_mtx);
   }
 
   // NOTREACHED
@@ -243,9 +299,102 @@ static void *vcpu_thread_fn(void *arg)
 struct  Vcpu_info {
   pthread_t tid;
   sem_t     block;
+  unsigned  poll_ns;  // halt polling window
+  unsigned long poll_hits, poll_misses;
+  bool      blocked;  // counted in blocked_vcpus
 };
 
 static std::vector<Vcpu_info> vcpu_info;
+static unsigned               blocked_vcpus;
+static unsigned               disk_inflight; // disk requests not yet committed
+
+// A blocking vCPU first polls for a wakeup. The window grows while
+// wakeups arrive shortly after it and shrinks when the vCPU sleeps long.
+enum {
+  HALT_POLL_START_NS = 10000,
+  HALT_POLL_MAX_NS   = 200000,
+};
+
+static unsigned long long monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static timevalue monotonic_raw_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Time skipped by time warping in clock ticks.
+static timevalue volatile warp_offset;
+
+static timevalue warped_tsc()          { return Cpu::rdtsc() + warp_offset; }
+static timevalue warped_monotonic_ns() { return monotonic_raw_ns() + warp_offset; }
+
+// Use the TSC as clock, if it ticks at a constant rate. Its frequency
+// is measured against CLOCK_MONOTONIC_RAW. Otherwise fall back to
+// clock_gettime.
+static Clock host_clock()
+{
+  unsigned ebx = 0, ecx = 0, edx = 0;
+  bool invariant = Cpu::cpuid(0x80000000, ebx, ecx, edx) >= 0x80000007 and
+    (ebx = ecx = edx = 0, Cpu::cpuid(0x80000007, ebx, ecx, edx), edx & (1 << 8));
+  if (!invariant) {
+    Logging::printf("TSC is not invariant. Using clock_gettime.\n");
+    return Clock(1000000000ULL, warped_monotonic_ns);
+  }
+
+  // Each timestamp is taken between two TSC reads, so the
+  // measurement does not depend on how long clock_gettime takes.
+  timevalue tsc_start = Cpu::rdtsc();
+  timevalue ns_start  = monotonic_raw_ns();
+  tsc_start = (tsc_start + Cpu::rdtsc()) / 2;
+
+  timevalue tsc_end, ns_end;
+  do {
+    Cpu::pause();
+    tsc_end = Cpu::rdtsc();
+    ns_end  = monotonic_raw_ns();
+    tsc_end = (tsc_end + Cpu::rdtsc()) / 2;
+  } while (ns_end - ns_start < 50000000ULL);
+  timevalue freq = Math::muldiv128(tsc_end - tsc_start, 1000000000ULL, ns_end - ns_start);
+
+  Logging::printf("TSC runs at %llu kHz.\n", freq / 1000);
+  return time_warp ? Clock(freq, warped_tsc) : Clock(freq);
+}
+
+static void block_vcpu(Vcpu_info &info)
+{
+  unsigned long long start = monotonic_ns();
+  for (unsigned long long now = start; now - start < info.poll_ns; now = monotonic_ns()) {
+    if (!sem_trywait(&info.block)) {
+      info.poll_hits++;
+      return;
+    }
+    Cpu::pause();
+  }
+
+  info.poll_misses++;
+  sem_wait(&info.block);
+  unsigned long long slept = monotonic_ns() - start;
+  if (slept <= HALT_POLL_MAX_NS)
+    info.poll_ns = info.poll_ns ? MIN(2 * info.poll_ns, unsigned(HALT_POLL_MAX_NS)) : unsigned(HALT_POLL_START_NS);
+  else if ((info.poll_ns /= 2) < HALT_POLL_START_NS)
+    info.poll_ns = 0;
+}
+
+void dump_vcpu_stats()
+{
+  for (unsigned i = 0; i < vcpu_info.size(); i++)
+    Logging::printf("vCPU %u: halt poll window %uns hits %lu misses %lu\n", i,
+                    vcpu_info[i].poll_ns, vcpu_info[i].poll_hits, vcpu_info[i].poll_misses);
+}
+
+static void warp_time();
 
 static bool receive(Device *, MessageHostOp &msg)
 {
@@ -279,17 +428,36 @@ static bool receive(Device *, MessageHostOp &msg)
         break;
       }
       pthread_setname_np(vcpu_info[msg.value].tid, "vcpu");
+      msg.vcpu->device_lock = &device_lock;
 
       break;
     }
-    case MessageHostOp::OP_VCPU_BLOCK:
-      pthread_mutex_unlock(&irq_mtx);
-      sem_wait(&vcpu_info[msg.value].block);
-      pthread_mutex_lock(&irq_mtx);
+    case MessageHostOp::OP_VCPU_BLOCK: {
+      Vcpu_info &info = vcpu_info[msg.value];
+      if (time_warp) {
+        if (!sem_trywait(&info.block)) break;
+        info.blocked = true;
+        blocked_vcpus++;
+        warp_time();
+      }
+      pthread_mutex_unlock(&device_mtx);
+      block_vcpu(info);
+      pthread_mutex_lock(&device_mtx);
+      if (info.blocked) {
+        info.blocked = false;
+        blocked_vcpus--;
+      }
       break;
-    case MessageHostOp::OP_VCPU_RELEASE:
-      sem_post(&vcpu_info[msg.value].block);
+    }
+    case MessageHostOp::OP_VCPU_RELEASE: {
+      Vcpu_info &info = vcpu_info[msg.value];
+      if (info.blocked) {
+        info.blocked = false;
+        blocked_vcpus--;
+      }
+      sem_post(&info.block);
       break;
+    }
     case MessageHostOp::OP_GET_MODULE:
       // For historical reasons, modules numbers start with 1.
       msg.module --;
@@ -330,7 +498,7 @@ static void timeout_trigger()
 
   // Force time reprogramming. Otherwise, we might not reprogram a
   // timer, if the timeout event reached us too early.
-  last_to = ~0ULL;
+  armed_ns = ~0ULL;
 
   // trigger all timeouts that are due
   unsigned nr;
@@ -354,29 +522,58 @@ static void timeout_request()
 
       // We might have a new timeout pending.
       timeout_request();
-    } else if (next_to != last_to) {
-      // New timeout. Reprogram timer.
+    } else {
+      // Round the absolute deadline up to the timer slack, so that
+      // timeouts close to each other share a single wakeup and
+      // rearming for such a timeout needs no syscall.
+      unsigned long long deadline = monotonic_ns() + delta;
+      if (timer_slack_ns)
+        deadline += timer_slack_ns - 1 - (deadline + timer_slack_ns - 1) % timer_slack_ns;
+      if (deadline == armed_ns) return;
 
-      last_to = next_to;
+      // New timeout. Reprogram timer.
+      armed_ns = deadline;
 
       // Logging::printf("Programming timer for %lluns.\n", delta);
 
       struct itimerspec t = {
         .it_interval = {0, 0},
-        .it_value = {long(delta / 1000000000L), (long)(delta % 1000000000L)}
+        .it_value = {long(deadline / 1000000000L), (long)(deadline % 1000000000L)}
       };
-      int res = timer_settime(timer_id, 0, &t, NULL);
+      int res = timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &t, NULL);
       assert(!res);
     }
   }
 }
 
-static void timeout_handler_fn(union sigval)
+// When all vCPUs are halted and no disk request is in flight, nothing
+// can happen before the next timeout. Jump there instead of sleeping.
+// The number of jumps is bounded, as timeouts that wake no vCPU would
+// otherwise let the time race ahead.
+static void warp_time()
 {
-  pthread_mutex_lock(&irq_mtx);
+  timevalue next;
+  for (unsigned i = 0; i < 64 and time_warp and blocked_vcpus == vcpu_info.size() and
+         !disk_inflight and (next = timeouts.timeout()) != ~0ULL; i++) {
+    timevalue now = mb_clock.time();
+    if (next > now) warp_offset = warp_offset + next - now;
+    timeout_trigger();
+    timeout_request();
+  }
+}
+
+static bool timer_expired(int, void *)
+{
+  uint64 expirations;
+  if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return true;
+
+  pthread_mutex_lock(&device_mtx);
   timeout_trigger();
   timeout_request();
-  pthread_mutex_unlock(&irq_mtx);
+  warp_time();
+  pthread_mutex_unlock(&device_mtx);
+  return true;
 }
 
 static bool receive(Device *, MessageTimer &msg)
@@ -403,7 +600,7 @@ static bool receive(Device *, MessageTime &msg)
   msg.timestamp = mb_clock.clock(MessageTime::FREQUENCY);
 
   assert(MessageTime::FREQUENCY == 1000000U);
-  msg.wallclocktime = (uint64)tv.tv_sec * 1000000 + tv.tv_usec;
+  msg.wallclocktime = (uint64)tv.tv_sec * 1000000 + tv.tv_usec + Math::muldiv128(warp_offset, MessageTime::FREQUENCY, mb_clock.freq());
   return true;
 }
 
@@ -411,30 +608,23 @@ static bool receive(Device *, MessageTime &msg)
 
 static unsigned char network_pbuf[2048];
 
-static void *network_io_thread_fn(void *)
+static bool network_receive(int fd, void *)
 {
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(tap_fd, &set);
-
-  while (true) {
-    fd_set rset = set;
-    if (0 > select(tap_fd + 1, &rset, nullptr, nullptr, nullptr)) {
-      perror("select");
-      break;
-    }
-
-    int  res = read(tap_fd, network_pbuf, sizeof(network_pbuf));
-    if (res <= 0) break;
-    printf("tap: read %u bytes.\n", res);
-    MessageNetwork msg(network_pbuf, res, 0);
-
-    pthread_mutex_lock(&irq_mtx);
-    mb.bus_network.send(msg);
-    pthread_mutex_unlock(&irq_mtx);
+  int  res = read(fd, network_pbuf, sizeof(network_pbuf));
+  if (res <= 0) {
+    // The I/O thread closes the TAP device, so stop sending to it.
+    pthread_mutex_lock(&device_mtx);
+    tap_fd = 0;
+    pthread_mutex_unlock(&device_mtx);
+    return false;
   }
+  printf("tap: read %u bytes.\n", res);
+  MessageNetwork msg(network_pbuf, res, 0);
 
-  return nullptr;
+  pthread_mutex_lock(&device_mtx);
+  mb.bus_network.send(msg);
+  pthread_mutex_unlock(&device_mtx);
+  return true;
 }
 
 static bool receive(Device *, MessageNetwork &msg)
@@ -456,45 +646,176 @@ static bool receive(Device *, MessageNetwork &msg)
 
 }
 
-static bool receive(Device *, MessageDisk &msg)
-{
-  if (msg.disknr >= disks.size()) return false;
+// Disk requests are executed by a pool of worker threads, so that
+// slow I/O does not stall the vCPU that issued it. Completed requests
+// are committed from the I/O thread.
+
+struct DiskRequest {
+  DiskRequest        *next;
+  MessageDisk::Type   type;
+  unsigned            disknr;
+  unsigned long       usertag;
+  unsigned long long  sector;
+  unsigned            dmacount;
+  DmaDescriptor      *dma;
+  unsigned long       physsize;
+  MessageDisk::Status status;
+};
 
-  Disk               &disk   = disks[msg.disknr];
-  MessageDisk::Status status = MessageDisk::DISK_OK;
-  unsigned long long  offset = msg.sector << 9;
+enum { DISK_WORKERS = 4 };
 
-  switch (msg.type) {
+static pthread_mutex_t disk_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  disk_cond = PTHREAD_COND_INITIALIZER;
+static DiskRequest    *disk_pending, **disk_pending_tail = &disk_pending;
+static DiskRequest    *disk_completed;
+static int             disk_event_fd;
+
+static void disk_execute(DiskRequest &req)
+{
+  Disk               &disk   = disks[req.disknr];
+  unsigned long long  offset = req.sector << 9;
+
+  req.status = MessageDisk::DISK_OK;
+  switch (req.type) {
   case MessageDisk::DISK_READ:
   case MessageDisk::DISK_WRITE:
-    for (unsigned i=0; i < msg.dmacount; i++) {
-      size_t  start = offset;
-      size_t  end   = start + msg.dma[i].bytecount;
-      ssize_t bytes;
-
-      if (end > disk.size or start > disk.size or
-          msg.dma[i].byteoffset > msg.physsize or
-          msg.dma[i].byteoffset + msg.dma[i].bytecount > msg.physsize) {
-        status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
-                                     (i << MessageDisk::DISK_STATUS_SHIFT));
-        break;
+    {
+      // Only the descriptors before the first invalid one are transferred.
+      unsigned valid = 0;
+      for (size_t end = offset; valid < req.dmacount; valid++) {
+        end += req.dma[valid].bytecount;
+        if (end > disk.size or
+            req.dma[valid].byteoffset > req.physsize or
+            req.dma[valid].byteoffset + req.dma[valid].bytecount > req.physsize) {
+          req.status = MessageDisk::Status(MessageDisk::DISK_STATUS_DEVICE |
+                                           (valid << MessageDisk::DISK_STATUS_SHIFT));
+          break;
+        }
       }
 
-      // XXX Workaround, use hostop GUEST_MEM.
-      msg.physoffset = reinterpret_cast<uintptr_t>(ram);
+      // Transfer them with as few syscalls as possible. Descriptors
+      // that are contiguous in guest memory share an iovec.
+      for (unsigned i = 0; i < valid;) {
+        struct iovec iov[IOV_MAX];
+        unsigned     count = 0;
+        size_t       len   = 0;
+        for (; i < valid; i++) {
+          char   *ptr   = ram + req.dma[i].byteoffset;
+          size_t  bytes = req.dma[i].bytecount;
+          if (count and static_cast<char *>(iov[count - 1].iov_base) + iov[count - 1].iov_len == ptr)
+            iov[count - 1].iov_len += bytes;
+          else if (count == IOV_MAX)
+            break;
+          else {
+            iov[count].iov_base = ptr;
+            iov[count].iov_len  = bytes;
+            count++;
+          }
+          len += bytes;
+        }
+
+        ssize_t bytes = (req.type == MessageDisk::DISK_READ) ?
+          preadv(disk.fd, iov, count, offset) : pwritev(disk.fd, iov, count, offset);
+
+        if (bytes < ssize_t(len)) {
+          Logging::printf("short read/write: %zd instead of %zd\n", bytes, len);
+        }
+
+        offset += len;
+      }
+    }
+    break;
+  case MessageDisk::DISK_FLUSH_CACHE:
+    if (fdatasync(disk.fd))
+      req.status = MessageDisk::DISK_STATUS_DEVICE;
+    break;
+  default:
+    assert(0);
+  }
+}
 
-      typedef int (*RWFn)(int,void *,size_t,off_t);
-      bytes = ((msg.type == MessageDisk::DISK_READ) ? (RWFn)pread : (RWFn)pwrite)
-        (disk.fd, reinterpret_cast<void *>(msg.dma[i].byteoffset + msg.physoffset),
-         end - start, start);
+static void *disk_worker_fn(void *)
+{
+  while (true) {
+    pthread_mutex_lock(&disk_mtx);
+    while (!disk_pending)
+      pthread_cond_wait(&disk_cond, &disk_mtx);
+    DiskRequest *req = disk_pending;
+    if (!(disk_pending = req->next)) disk_pending_tail = &disk_pending;
+    pthread_mutex_unlock(&disk_mtx);
+
+    disk_execute(*req);
+
+    pthread_mutex_lock(&disk_mtx);
+    req->next = disk_completed;
+    disk_completed = req;
+    pthread_mutex_unlock(&disk_mtx);
+
+    uint64 one = 1;
+    if (write(disk_event_fd, &one, sizeof(one)) != sizeof(one))
+      perror("disk completion");
+  }
+  return nullptr;
+}
 
-      if (bytes < ssize_t(end - start)) {
-        Logging::printf("short read/write: %zd instead of %zd\n", bytes, end - start);
-      }
+static bool disk_completion(int fd, void *)
+{
+  uint64 count;
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) return true;
+
+  pthread_mutex_lock(&disk_mtx);
+  DiskRequest *done = disk_completed;
+  disk_completed = nullptr;
+  pthread_mutex_unlock(&disk_mtx);
+
+  pthread_mutex_lock(&device_mtx);
+  while (DiskRequest *req = done) {
+    done = req->next;
+    if (req->type == MessageDisk::DISK_READ and req->status == MessageDisk::DISK_OK)
+      for (unsigned i=0; i < req->dmacount; i++)
+        mb.mark_written(req->dma[i].byteoffset, req->dma[i].bytecount);
+
+    MessageDiskCommit cmsg(req->disknr, req->usertag, req->status);
+    mb.bus_diskcommit.send(cmsg);
+    delete [] req->dma;
+    delete req;
+    disk_inflight--;
+  }
+  warp_time();
+  pthread_mutex_unlock(&device_mtx);
+  return true;
+}
+
+static bool receive(Device *, MessageDisk &msg)
+{
+  if (msg.disknr >= disks.size()) return false;
 
-      offset += end - start;
+  Disk &disk = disks[msg.disknr];
+  switch (msg.type) {
+  case MessageDisk::DISK_READ:
+  case MessageDisk::DISK_WRITE:
+  case MessageDisk::DISK_FLUSH_CACHE:
+    {
+      // The caller may reuse its descriptors once we return.
+      DiskRequest *req = new DiskRequest;
+      req->next     = nullptr;
+      req->type     = msg.type;
+      req->disknr   = msg.disknr;
+      req->usertag  = msg.usertag;
+      req->sector   = msg.sector;
+      req->dmacount = msg.type == MessageDisk::DISK_FLUSH_CACHE ? 0 : msg.dmacount;
+      req->dma      = new DmaDescriptor[req->dmacount];
+      req->physsize = msg.physsize;
+      memcpy(req->dma, msg.dma, req->dmacount * sizeof(*req->dma));
+
+      disk_inflight++;
+      pthread_mutex_lock(&disk_mtx);
+      *disk_pending_tail = req;
+      disk_pending_tail  = &req->next;
+      pthread_cond_signal(&disk_cond);
+      pthread_mutex_unlock(&disk_mtx);
+      return true;
     }
-    break;
   case MessageDisk::DISK_GET_PARAMS:
     {
       msg.params->flags = DiskParameter::FLAG_HARDDISK;
@@ -504,21 +825,15 @@ static bool receive(Device *, MessageDisk &msg)
       strncpy(msg.params->name, disk.name, sizeof(msg.params->name));
       return true;
     }
-  case MessageDisk::DISK_FLUSH_CACHE:
-    break;
   default:
     assert(0);
   }
-
-  MessageDiskCommit cmsg(msg.disknr, msg.usertag, status);
-  mb.bus_diskcommit.send(cmsg);
-
-  return true;
+  return false;
 }
 
 static void usage()
 {
-  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [kernel parameters] [module1 parameters] ...\n");
+  fprintf(stderr, "Usage: seoul [-m RAM] [-n tap-device] [-j] [-c vCPUs] [-s timer-slack-us] [-w] [kernel parameters] [module1 parameters] ...\n");
   exit(EXIT_FAILURE);
 }
 
@@ -529,7 +844,7 @@ int main(int argc, char **argv)
          version_str);
 
   int ch;
-  while ((ch = getopt(argc, argv, "hm:n:d:")) != -1) {
+  while ((ch = getopt(argc, argv, "hm:n:d:jc:s:w")) != -1) {
     switch (ch) {
     case 'm':
       ram_size = atoi(optarg) << 20;
@@ -544,6 +859,22 @@ int main(int argc, char **argv)
     case 'd':
       disks.push_back(Disk::from_file(optarg));
       break;
+    case 'j':
+      use_jit = true;
+      break;
+    case 'c':
+      vcpu_count = atoi(optarg);
+      if (vcpu_count < 1 or vcpu_count > 254) {
+        fprintf(stderr, "The number of vCPUs must be between 1 and 254.\n");
+        return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      timer_slack_ns = atoi(optarg) * 1000;
+      break;
+    case 'w':
+      time_warp = true;
+      break;
     case 'h':
     case '?':
     default:
@@ -570,17 +901,42 @@ int main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
-  // Creating timer. I hate C++: No useful initializers...
-  struct sigevent ev;
-  ev.sigev_notify            = SIGEV_THREAD;
-  ev.sigev_notify_attributes = NULL;
-  ev.sigev_notify_function   = timeout_handler_fn;
+  mb_clock = host_clock();
 
-  if (0 != timer_create(CLOCK_MONOTONIC, &ev, &timer_id)) {
-    perror("timer_create");
+  // Creating the I/O reactor. Devices register their file descriptors
+  // while they are created.
+  if (0 > (io_epoll_fd = epoll_create1(EPOLL_CLOEXEC))) {
+    perror("epoll_create1");
     return EXIT_FAILURE;
   }
 
+  // Creating timer. It is armed with absolute deadlines and served
+  // by the I/O thread.
+  if (0 > (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) {
+    perror("timerfd_create");
+    return EXIT_FAILURE;
+  }
+  io_add(timer_fd, timer_expired, nullptr);
+  if (tap_fd) io_add(tap_fd, network_receive, nullptr);
+
+  // Creating disk workers.
+  if (disks.size()) {
+    if (0 > (disk_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) {
+      perror("eventfd");
+      return EXIT_FAILURE;
+    }
+    io_add(disk_event_fd, disk_completion, nullptr);
+
+    for (unsigned i = 0; i < DISK_WORKERS; i++) {
+      pthread_t worker;
+      if (0 != pthread_create(&worker, NULL, disk_worker_fn, NULL)) {
+        perror("pthread_create");
+        return EXIT_FAILURE;
+      }
+      pthread_setname_np(worker, "disk");
+    }
+  }
+
 
   mb.bus_hostop .add(nullptr, receive);
   mb.bus_timer  .add(nullptr, receive);
@@ -590,16 +946,28 @@ int main(int argc, char **argv)
   mb.bus_disk   .add(nullptr, receive);
 
   // Synchronization initialization
-  if (0 != pthread_mutex_init(&irq_mtx, nullptr)) {
+  if (0 != pthread_mutex_init(&device_mtx, nullptr)) {
     perror("pthread_mutex_init");
     return EXIT_FAILURE;
   }
-  pthread_mutex_lock(&irq_mtx);
+  pthread_mutex_lock(&device_mtx);
+
+  // vCPU threads access their info without holding the device lock
+  vcpu_info.reserve(vcpu_count);
 
   // Create standard PC
   for (const char **dev = pc_ps2; *dev != NULL; dev++) {
     mb.handle_arg(*dev);
   }
+  // Disks are also attached to the ports of the AHCI controller.
+  for (unsigned i = 0; i < disks.size() && i < 32; i++) {
+    char arg[32];
+    snprintf(arg, sizeof(arg), "drive:%u,0,%u", i, i);
+    mb.handle_arg(arg);
+  }
+  for (unsigned i = 0; i < vcpu_count; i++)
+    for (const char **dev = pc_vcpu; *dev != NULL; dev++)
+      mb.handle_arg(use_jit && !strcmp(*dev, "halifax") ? "jit" : *dev);
 
   Logging::printf("Devices and %zu virtual CPU%s started successfully.\n",
                   vcpu_info.size(), vcpu_info.size() == 1 ? "" : "s");
@@ -629,18 +997,16 @@ int main(int argc, char **argv)
   MessageLegacy msg2(MessageLegacy::RESET, 0);
   mb.bus_legacy.send_fifo(msg2);
 
+  Logging::printf("Starting background threads.\n");
   pthread_t iothread;
-  if (tap_fd) {
-    Logging::printf("Starting background threads.\n");
-    if (0 != pthread_create(&iothread, NULL, network_io_thread_fn, NULL)) {
-      perror("pthread_create");
-      return EXIT_FAILURE;
-    }
-    pthread_setname_np(iothread, "io");
+  if (0 != pthread_create(&iothread, NULL, io_thread_fn, NULL)) {
+    perror("pthread_create");
+    return EXIT_FAILURE;
   }
+  pthread_setname_np(iothread, "io");
 
   Logging::printf("Virtual CPUs starting.\n");
-  pthread_mutex_unlock(&irq_mtx);
+  pthread_mutex_unlock(&device_mtx);
 
   // Waiting for CPUs to exit.
   for (Vcpu_info &i : vcpu_info)
@@ -24,6 +24,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include <seoul/unix.h>
 
@@ -84,14 +85,66 @@ class NcursesDisplay : public StaticReceiver<NcursesDisplay> {
     }
   }
 
-  void display_loop()
+  void render()
+  {
+    for (unsigned y = 0; y < 25; y ++)
+      render_line(y);
+    render_bar();
+    refresh();
+  }
+
+  void handle_key(int key)
+  {
+    switch (key) {
+    case 'q':
+      endwin();
+
+      // XXX Not the nice way...
+      exit(EXIT_SUCCESS);
+    case KEY_HOME: {
+      MessageConsole msg(MessageConsole::TYPE_RESET);
+      pthread_mutex_lock(&device_mtx);
+      mb.bus_console.send(msg);
+      pthread_mutex_unlock(&device_mtx);
+    }
+      break;
+
+    case KEY_F(12): {
+      pthread_mutex_lock(&device_mtx);
+      CpuEvent msg(VCpu::EVENT_DEBUG);
+      for (VCpu *vcpu = mb.last_vcpu; vcpu; vcpu=vcpu->get_last())
+        vcpu->bus_event.send(msg);
+      dump_vcpu_stats();
+      pthread_mutex_unlock(&device_mtx);
+    }
+      break;
+
+    case KEY_LEFT:
+    case KEY_UP:
+      if (current_view) current_view --;
+      break;
+    case KEY_RIGHT:
+    case KEY_DOWN:
+      if (views.size())
+        if (current_view < views.size() - 1)
+          current_view ++;
+      break;
+    case ERR:
+    default:
+      break;
+    }
+  }
+
+public:
+
+  void start()
   {
     initscr();
     raw();
     noecho();
     nonl();
     keypad(stdscr, TRUE);
-    timeout(100);
+    timeout(0);
     curs_set(0);
     start_color();
 
@@ -112,59 +165,32 @@ class NcursesDisplay : public StaticReceiver<NcursesDisplay> {
     }
 
     clear();
-    while (true) {
-      for (unsigned y = 0; y < 25; y ++)
-        render_line(y);
-      render_bar();
-      refresh();
-      switch (getch()) {
-      case 'q':
-        goto done;
-      case KEY_HOME: {
-        MessageConsole msg(MessageConsole::TYPE_RESET);
-        pthread_mutex_lock(&irq_mtx);
-        mb.bus_console.send(msg);
-        pthread_mutex_unlock(&irq_mtx);
-      }
-        break;
 
-      case KEY_F(12): {
-        pthread_mutex_lock(&irq_mtx);
-        CpuEvent msg(VCpu::EVENT_DEBUG);
-        for (VCpu *vcpu = mb.last_vcpu; vcpu; vcpu=vcpu->get_last())
-          vcpu->bus_event.send(msg);
-        pthread_mutex_unlock(&irq_mtx);
-      }
-        break;
-
-      case KEY_LEFT:
-      case KEY_UP:
-        if (current_view) current_view --;
-        break;
-      case KEY_RIGHT:
-      case KEY_DOWN:
-        if (views.size())
-          if (current_view < views.size() - 1)
-            current_view ++;
-        break;
-      case ERR:
-      default:
-        break;
-      }
-    }
-  done:
-    endwin();
+    // Keys are handled as they arrive, the screen is redrawn every 100ms.
+    struct itimerspec t = { {0, 100000000}, {0, 100000000} };
+    int refresh_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (refresh_fd < 0 or timerfd_settime(refresh_fd, 0, &t, nullptr))
+      Logging::panic("ncurses: could not create refresh timer.\n");
 
-    // XXX Not the nice way...
-    exit(EXIT_SUCCESS);
+    io_add(STDIN_FILENO, input_ready,  this);
+    io_add(refresh_fd,   refresh_due, this);
   }
 
-public:
+  static bool input_ready(int, void *arg)
+  {
+    NcursesDisplay *d = reinterpret_cast<NcursesDisplay *>(arg);
+    for (int key; (key = getch()) != ERR;)
+      d->handle_key(key);
+    d->render();
+    return true;
+  }
 
-  static void *display_loop(void *arg)
+  static bool refresh_due(int fd, void *arg)
   {
-    reinterpret_cast<NcursesDisplay *>(arg)->display_loop();
-    return nullptr;
+    uint64 expirations;
+    if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+      reinterpret_cast<NcursesDisplay *>(arg)->render();
+    return true;
   }
 
   bool receive(MessageConsole &msg)
@@ -208,8 +234,7 @@ PARAM_HANDLER(ncurses,
 
   mb.bus_console.add(d, NcursesDisplay::receive_static<MessageConsole>);
 
-  pthread_t p;
-  pthread_create(&p, NULL, NcursesDisplay::display_loop, d);
+  d->start();
 }
 
 // EOF